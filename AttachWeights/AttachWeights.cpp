@@ -15,7 +15,7 @@ struct ArgData
 {
     ArgData() :
         stopAtMesh(false), stopAfterCircles(false), skelScale(1.), noFit(true),
-        skeleton(HumanSkeleton()), stiffness(1.),
+        skeleton(HumanSkeleton()), stiffness(1.), ordering(SPDMatrix::APPROXIMATE_MINIMUM_DEGREE), lbfgsEvals(-1),
         skelOutName("skeleton.out"), weightOutName("attachment.out")
     {
     }
@@ -29,8 +29,12 @@ struct ArgData
     Skeleton skeleton;
     string skeletonname;
     double stiffness;
+    SPDMatrix::Ordering ordering;
+    int lbfgsEvals; //evaluation budget for L-BFGS refinement (0 for none), -1 to not use it
     string skelOutName;
     string weightOutName;
+    MedialBudget medialBudget;
+    EmbedOptions embedOptions;
 };
 
 
@@ -39,8 +43,10 @@ void printUsageAndExit()
     cout << "Usage: attachWeights filename.{obj | ply | off | gts | stl}" << endl;
     cout << "              [-skel skelname] [-rot x y z deg]* [-scale s]" << endl;
     cout << "              [-meshonly | -mo] [-circlesonly | -co]" << endl;
-    cout << "              [-fit] [-stiffness s]" << endl;
+    cout << "              [-fit] [-stiffness s] [-nestedDissection]" << endl;
     cout << "              [-skelOut skelOutFile] [-weightOut weightOutFile]" << endl;
+    cout << "              [-medialSamples n] [-medialTime seconds] [-coarseSpheres n]" << endl;
+    cout << "              [-numMatches n] [-lbfgs maxEvals]" << endl;
 
     exit(0);
 }
@@ -118,6 +124,10 @@ ArgData processArgs(const vector<string> &args)
             sscanf(args[cur++].c_str(), "%lf", &out.stiffness);
             continue;
         }
+        if(curStr == string("-nestedDissection")) {
+            out.ordering = SPDMatrix::NESTED_DISSECTION;
+            continue;
+        }
         if(curStr == string("-skelOut")) {
             if(cur == num) {
                 cout << "No skeleton output specified; ignoring." << endl;
@@ -136,6 +146,46 @@ ArgData processArgs(const vector<string> &args)
             out.weightOutName = curStr;
             continue;
         }
+        if(curStr == string("-medialSamples")) {
+            if(cur >= num) {
+                cout << "No sample budget provided; exiting." << endl;
+                printUsageAndExit();
+            }
+            sscanf(args[cur++].c_str(), "%d", &out.medialBudget.maxSamples);
+            continue;
+        }
+        if(curStr == string("-medialTime")) {
+            if(cur >= num) {
+                cout << "No time budget provided; exiting." << endl;
+                printUsageAndExit();
+            }
+            sscanf(args[cur++].c_str(), "%lf", &out.medialBudget.maxSeconds);
+            continue;
+        }
+        if(curStr == string("-coarseSpheres")) {
+            if(cur >= num) {
+                cout << "No coarse sphere count provided; exiting." << endl;
+                printUsageAndExit();
+            }
+            sscanf(args[cur++].c_str(), "%d", &out.embedOptions.coarseSpheres);
+            continue;
+        }
+        if(curStr == string("-numMatches")) {
+            if(cur >= num) {
+                cout << "No match count provided; exiting." << endl;
+                printUsageAndExit();
+            }
+            sscanf(args[cur++].c_str(), "%d", &out.embedOptions.numMatches);
+            continue;
+        }
+        if(curStr == string("-lbfgs")) {
+            if(cur >= num) {
+                cout << "No evaluation budget provided; exiting." << endl;
+                printUsageAndExit();
+            }
+            sscanf(args[cur++].c_str(), "%d", &out.lbfgsEvals);
+            continue;
+        }
         cout << "Unrecognized option: " << curStr << endl;
         printUsageAndExit();
     }
@@ -171,7 +221,9 @@ void process(const vector<string> &args)
 
     PinocchioOutput o;
     if(!a.noFit) { //do everything
-        o = autorig(given, m);
+        LBFGSOptimizer lbfgs;
+        lbfgs.maxEvals = a.lbfgsEvals;
+        o = autorig(given, m, a.medialBudget, a.embedOptions, a.lbfgsEvals >= 0 ? &lbfgs : NULL);
     }
     else { //skip the fitting step--assume the skeleton is already correct for the mesh
         TreeType *distanceField = constructDistanceField(m);
@@ -181,7 +233,7 @@ void process(const vector<string> &args)
         for(i = 0; i < (int)o.embedding.size(); ++i)
             o.embedding[i] = m.toAdd + o.embedding[i] * m.scale;
 
-		o.attachment = new Attachment(m, a.skeleton, o.embedding, tester, a.stiffness);
+		o.attachment = new Attachment(m, a.skeleton, o.embedding, tester, a.stiffness, NULL, a.ordering);
 
         delete tester;
         delete distanceField;
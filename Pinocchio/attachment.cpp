@@ -47,7 +47,7 @@ public:
     AttachmentPrivate1() {}
 
     AttachmentPrivate1(const Mesh &mesh, const Skeleton &skeleton, const vector<Vector3> &match, const VisibilityTester *tester,
-		double initialHeatWeight)
+		double initialHeatWeight, SymbolicFactor *symbolic, SPDMatrix::Ordering ordering)
     {
         int i, j;
         int nv = mesh.vertices.size();
@@ -162,23 +162,41 @@ public:
 
         nzweights.resize(nv);
         SPDMatrix Am(A);
-        LLTMatrix *Ainv = Am.factor();
+        Am.setOrdering(ordering);
+        if(ordering == SPDMatrix::NESTED_DISSECTION) {
+            vector<Vector3> positions(nv);
+            for(i = 0; i < nv; ++i)
+                positions[i] = mesh.vertices[i].pos;
+            Am.setPositions(positions);
+        }
+        if(symbolic != NULL && !symbolic->matches(A))
+            Am.analyze(*symbolic);
+        LLTMatrix *Ainv = (symbolic != NULL) ? Am.factor(*symbolic) : Am.factor();
         if(Ainv == NULL)
             return;
 
-        for(j = 0; j < bones; ++j) {
-            vector<double> rhs(nv, 0.);
+        //solve for a block of bones at a time (interleaved), so the factor is read once per block
+        int block = Ainv->getBlockWidth();
+        vector<double> rhs;
+        for(int start = 0; start < bones; start += block) {
+            int width = min(block, bones - start);
+            rhs.assign(nv * width, 0.);
             for(i = 0; i < nv; ++i) {
-                if(boneVis[i][j] && boneDists[i][j] <= boneDists[i][closest[i]] * 1.00001)
-                    rhs[i] = H[i] / D[i];
+                for(j = start; j < start + width; ++j) {
+                    if(boneVis[i][j] && boneDists[i][j] <= boneDists[i][closest[i]] * 1.00001)
+                        rhs[i * width + j - start] = H[i] / D[i];
+                }
             }
 
-            Ainv->solve(rhs);
+            Ainv->solveMany(&rhs[0], width);
             for(i = 0; i < nv; ++i) {
-                if(rhs[i] > 1.)
-                    rhs[i] = 1.; //clip just in case
-                if(rhs[i] > 1e-8)
-                    nzweights[i].push_back(make_pair(j, rhs[i]));
+                for(j = start; j < start + width; ++j) {
+                    double &val = rhs[i * width + j - start];
+                    if(val > 1.)
+                        val = 1.; //clip just in case
+                    if(val > 1e-8)
+                        nzweights[i].push_back(make_pair(j, val));
+                }
             }
         }
 
@@ -252,7 +270,7 @@ Mesh Attachment::deform(const Mesh &mesh, const vector<Transform<> > &transforms
 }
 
 Attachment::Attachment(const Mesh &mesh, const Skeleton &skeleton, const vector<Vector3> &match, const VisibilityTester *tester,
-					   double initialHeatWeight)
+					   double initialHeatWeight, SymbolicFactor *symbolic, SPDMatrix::Ordering ordering)
 {
-    a = new AttachmentPrivate1(mesh, skeleton, match, tester, initialHeatWeight);
+    a = new AttachmentPrivate1(mesh, skeleton, match, tester, initialHeatWeight, symbolic, ordering);
 }
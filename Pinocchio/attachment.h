@@ -22,6 +22,7 @@
 #include "mesh.h"
 #include "skeleton.h"
 #include "transform.h"
+#include "lsqSolver.h"
 
 class VisibilityTester
 {
@@ -68,7 +69,12 @@ class PINOCCHIO_API Attachment
 public:
     Attachment() : a(NULL) {}
     Attachment(const Attachment &);
-    Attachment(const Mesh &mesh, const Skeleton &skeleton, const vector<Vector3> &match, const VisibilityTester *tester, double initialHeatWeight=1.);
+    //Attachments to meshes with the same connectivity can share a symbolic factorization of the
+    //Laplacian: if symbolic is given, it is used if it matches and is (re)computed otherwise.
+    //ordering is the fill-reducing ordering of the Laplacian (nested dissection uses the vertex positions).
+    Attachment(const Mesh &mesh, const Skeleton &skeleton, const vector<Vector3> &match, const VisibilityTester *tester,
+               double initialHeatWeight=1., SymbolicFactor *symbolic=NULL,
+               SPDMatrix::Ordering ordering=SPDMatrix::APPROXIMATE_MINIMUM_DEGREE);
     virtual ~Attachment();
 
     Mesh deform(const Mesh &mesh, const vector<Transform<> > &transforms) const;
@@ -19,15 +19,39 @@
 #ifndef DEBUGGING_H
 #define DEBUGGING_H
 
+#include <iostream>
 #include "mathutils.h"
 
 class Debugging
 {
 public:
-    static ostream &out() { return *outStream; }
+    static ostream &out() { ostream *os = threadStream(); return os ? *os : *outStream; }
     static void PINOCCHIO_API setOutStream(ostream &os) { outStream = &os; }
 
+    //While it exists, what the thread that created it logs is discarded (e.g., for work done in
+    //parallel, whose logs would be interleaved).  Other threads and the log stream are unaffected.
+    class PINOCCHIO_API Quiet
+    {
+    public:
+        Quiet();
+        ~Quiet();
+
+    private:
+        class NullBuf : public streambuf
+        {
+        protected:
+            int overflow(int c) { return traits_type::not_eof(c); }
+            streamsize xsputn(const char *, streamsize n) { return n; }
+        };
+
+        NullBuf buf;
+        ostream stream;
+        ostream *previous;
+    };
+
 private:
+    static PINOCCHIO_API ostream *&threadStream(); //the calling thread's stream, if it has its own
+
     static ostream *outStream;
 };
 
@@ -0,0 +1,312 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+
+#include <algorithm>
+#include "delaunay.h"
+#include "rect.h"
+#include "indexer.h"
+#include "debugging.h"
+
+namespace {
+struct Tet
+{
+    int v[4]; //positively oriented
+    int nb[4]; //nb[i] is across the face opposite v[i], -1 if none
+    bool dead;
+};
+
+class DelaunayBuilder
+{
+public:
+    DelaunayBuilder(const vector<Vector3> &inPts) : pts(inPts), lastTet(0) {}
+
+    bool insert(int p); //false if p could not be inserted
+    void makeSuper();
+    const vector<Tet> &getTets() const { return tets; }
+
+private:
+    //positive if d is on the positive side of abc
+    double orient(int a, int b, int c, int d) const
+    {
+        const Vector3 &pa = pts[a];
+        return (pts[b] - pa) * ((pts[c] - pa) % (pts[d] - pa));
+    }
+
+    //positive if e is inside the circumsphere of the positively oriented tet abcd
+    double insphere(int a, int b, int c, int d, int e) const
+    {
+        const Vector3 &pe = pts[e];
+        Vector3 ae = pts[a] - pe, be = pts[b] - pe, ce = pts[c] - pe, de = pts[d] - pe;
+        double al = ae.lengthsq(), bl = be.lengthsq(), cl = ce.lengthsq(), dl = de.lengthsq();
+
+        //expand the 4x4 determinant along the lifted column
+        return al * (be * (ce % de)) - bl * (ae * (ce % de)) + cl * (ae * (be % de)) - dl * (ae * (be % ce));
+    }
+
+    double replaceOrient(const Tet &t, int i, int p) const
+    {
+        int v[4] = { t.v[0], t.v[1], t.v[2], t.v[3] };
+        v[i] = p;
+        return orient(v[0], v[1], v[2], v[3]);
+    }
+
+    bool inConflict(int t, int p) const
+    {
+        const int *v = tets[t].v;
+        return insphere(v[0], v[1], v[2], v[3], p) > 0.;
+    }
+
+    int locate(int p) const;
+
+    vector<Vector3> pts;
+    vector<Tet> tets;
+    int lastTet;
+
+    //scratch space for insertion
+    vector<int> cavity;
+    vector<bool> inCavity;
+};
+
+void DelaunayBuilder::makeSuper()
+{
+    int i;
+    Rect3 bounds(pts.begin(), pts.end());
+    double size = max(1e-8, bounds.getSize().accumulate(ident<double>(), maximum<double>()));
+    Vector3 c = bounds.getCenter();
+    double s = 20. * size;
+
+    int n = pts.size();
+    pts.push_back(c + Vector3(s, s, s));
+    pts.push_back(c + Vector3(s, -s, -s));
+    pts.push_back(c + Vector3(-s, s, -s));
+    pts.push_back(c + Vector3(-s, -s, s));
+
+    Tet t;
+    for(i = 0; i < 4; ++i) {
+        t.v[i] = n + i;
+        t.nb[i] = -1;
+    }
+    t.dead = false;
+    if(orient(t.v[0], t.v[1], t.v[2], t.v[3]) < 0.)
+        swap(t.v[0], t.v[1]);
+    tets.push_back(t);
+    inCavity.push_back(false);
+}
+
+int DelaunayBuilder::locate(int p) const
+{
+    int i, t = lastTet;
+    int maxSteps = 50 + 4 * (int)sqrt(double(tets.size()));
+
+    //visibility walk, starting from a different face each step so it doesn't cycle
+    for(int step = 0; step < maxSteps; ++step) {
+        int next = -1;
+        for(i = 0; i < 4; ++i) {
+            int face = (i + step) & 3;
+            if(tets[t].nb[face] >= 0 && replaceOrient(tets[t], face, p) < 0.) {
+                next = tets[t].nb[face];
+                break;
+            }
+        }
+        if(next < 0)
+            return t;
+        t = next;
+    }
+
+    //the walk got lost--fall back to looking at every tet for the one containing p (or, if
+    //roundoff leaves p outside all of them, the one that comes closest to containing it)
+    int best = -1;
+    double bestOrient = 0.;
+    for(t = 0; t < (int)tets.size(); ++t) {
+        if(tets[t].dead)
+            continue;
+        double minOrient = replaceOrient(tets[t], 0, p);
+        for(i = 1; i < 4; ++i)
+            minOrient = min(minOrient, replaceOrient(tets[t], i, p));
+        if(minOrient >= 0.)
+            return t;
+        if(best < 0 || minOrient > bestOrient) {
+            best = t;
+            bestOrient = minOrient;
+        }
+    }
+    return best;
+}
+
+bool DelaunayBuilder::insert(int p)
+{
+    int i, j, k;
+    int start = locate(p);
+    if(start < 0)
+        return false;
+    for(i = 0; i < 4; ++i)
+        if(pts[tets[start].v[i]] == pts[p])
+            return false; //the new tets would be flat
+
+    //collect the cavity: the connected set of tets whose circumspheres contain p
+    cavity.clear();
+    cavity.push_back(start);
+    inCavity[start] = true;
+    for(i = 0; i < (int)cavity.size(); ++i) {
+        const Tet &t = tets[cavity[i]];
+        for(j = 0; j < 4; ++j) {
+            int n = t.nb[j];
+            if(n < 0 || inCavity[n])
+                continue;
+            //if p can't see the face, roundoff made the cavity non-star-shaped--grow it
+            if(inConflict(n, p) || replaceOrient(t, j, p) <= 0.) {
+                inCavity[n] = true;
+                cavity.push_back(n);
+            }
+        }
+    }
+
+    //connect p to the boundary faces of the cavity
+    int firstNew = tets.size();
+    hash_map<pair<int, int>, pair<int, int> > openFaces; //boundary edge -> new tet, face index
+    for(i = 0; i < (int)cavity.size(); ++i) {
+        Tet t = tets[cavity[i]];
+        for(j = 0; j < 4; ++j) {
+            int n = t.nb[j];
+            if(n >= 0 && inCavity[n])
+                continue;
+
+            int idx = tets.size();
+            Tet nt = t;
+            nt.v[j] = p;
+            nt.dead = false;
+            for(k = 0; k < 4; ++k)
+                nt.nb[k] = -1;
+            nt.nb[j] = n;
+            if(n >= 0) {
+                for(k = 0; k < 4; ++k)
+                    if(tets[n].nb[k] == cavity[i])
+                        tets[n].nb[k] = idx;
+            }
+            tets.push_back(nt);
+            inCavity.push_back(false);
+
+            //the other faces of the new tet contain p and an edge of the boundary face
+            for(k = 0; k < 4; ++k) {
+                if(k == j)
+                    continue;
+                int e1 = -1, e2 = -1;
+                for(int q = 0; q < 4; ++q) {
+                    if(q == j || q == k)
+                        continue;
+                    if(e1 < 0)
+                        e1 = nt.v[q];
+                    else
+                        e2 = nt.v[q];
+                }
+                pair<int, int> key(min(e1, e2), max(e1, e2));
+                hash_map<pair<int, int>, pair<int, int> >::iterator it = openFaces.find(key);
+                if(it == openFaces.end())
+                    openFaces[key] = make_pair(idx, k);
+                else {
+                    tets[idx].nb[k] = it->second.first;
+                    tets[it->second.first].nb[it->second.second] = idx;
+                    openFaces.erase(it);
+                }
+            }
+        }
+    }
+
+    for(i = 0; i < (int)cavity.size(); ++i) {
+        tets[cavity[i]].dead = true;
+        inCavity[cavity[i]] = false;
+    }
+    if(firstNew < (int)tets.size())
+        lastTet = firstNew;
+    return true;
+}
+
+bool mortonLess(const pair<unsigned int, int> &p1, const pair<unsigned int, int> &p2) { return p1 < p2; }
+} //namespace
+
+vector<vector<int> > delaunayNeighbors(const vector<Vector3> &inPts)
+{
+    int i, j, k;
+    int n = inPts.size();
+    vector<vector<int> > out(n);
+    if(n < 2)
+        return out;
+
+    //perturb points deterministically so that lattice-aligned inputs aren't degenerate
+    Rect3 bounds(inPts.begin(), inPts.end());
+    Vector3 size = bounds.getSize();
+    double scale = max(1e-8, size.accumulate(ident<double>(), maximum<double>()));
+    vector<Vector3> pts(n);
+    unsigned int seed = 12345;
+    for(i = 0; i < n; ++i) {
+        for(j = 0; j < 3; ++j) {
+            seed = seed * 1664525u + 1013904223u;
+            pts[i][j] = inPts[i][j] + scale * 1e-9 * (double(seed >> 8) / double(1 << 24) - 0.5);
+        }
+    }
+
+    //insert along a space-filling curve so that point location walks are short
+    vector<pair<unsigned int, int> > order(n);
+    for(i = 0; i < n; ++i) {
+        Vector3 unit = (pts[i] - bounds.getLo()) / (scale * 1.0001);
+        for(j = 0; j < 3; ++j)
+            unit[j] = max(0., min(unit[j], 0.9999));
+        order[i] = make_pair(_lookup(unit), i);
+    }
+    sort(order.begin(), order.end(), mortonLess);
+
+    DelaunayBuilder builder(pts);
+    builder.makeSuper();
+    vector<int> failed;
+    for(i = 0; i < n; ++i)
+        if(!builder.insert(order[i].second))
+            failed.push_back(order[i].second);
+
+    const vector<Tet> &tets = builder.getTets();
+    for(i = 0; i < (int)tets.size(); ++i) {
+        if(tets[i].dead)
+            continue;
+        for(j = 1; j < 4; ++j) for(k = 0; k < j; ++k) {
+            int v1 = tets[i].v[j], v2 = tets[i].v[k];
+            if(v1 >= n || v2 >= n)
+                continue; //super tetrahedron vertex
+            out[v1].push_back(v2);
+            out[v2].push_back(v1);
+        }
+    }
+
+    //points that could not be inserted are paired with everything, as if there were no triangulation
+    if(!failed.empty())
+        Debugging::out() << "Delaunay: could not insert " << failed.size() << " points" << endl;
+    for(i = 0; i < (int)failed.size(); ++i) {
+        for(j = 0; j < n; ++j) {
+            if(j == failed[i])
+                continue;
+            out[failed[i]].push_back(j);
+            out[j].push_back(failed[i]);
+        }
+    }
+
+    for(i = 0; i < n; ++i) {
+        sort(out[i].begin(), out[i].end());
+        out[i].erase(unique(out[i].begin(), out[i].end()), out[i].end());
+    }
+
+    return out;
+}
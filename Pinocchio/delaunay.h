@@ -0,0 +1,29 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef DELAUNAY_H
+#define DELAUNAY_H
+
+#include "vector.h"
+
+//computes the edges of the Delaunay tetrahedralization of pts, which should be distinct.
+//The points are perturbed very slightly to break degeneracies.  Output is, for every point,
+//the sorted list of its Delaunay neighbors.
+vector<vector<int> > PINOCCHIO_API delaunayNeighbors(const vector<Vector3> &pts);
+
+#endif //DELAUNAY_H
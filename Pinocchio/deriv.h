@@ -21,26 +21,155 @@
 
 #include "vector.h"
 
+//not on 32-bit windows, where MSVC can't pass the (over-aligned) SIMD types by value, which std::vector does
+#if !defined(PINOCCHIO_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+#define DERIV_SSE2
+#include <emmintrin.h>
+#endif
+
+//The partial derivatives of a Deriv are a Vector, except for the common small numbers of double
+//variables, where they are operated on two at a time with SSE2 (define PINOCCHIO_NO_SIMD to turn
+//this off).  Both support the same operations, so Deriv does not care which it has.
+template<class Real, int Vars> struct DerivPartials { typedef Vector<Real, Vars> Type; };
+
+#ifdef DERIV_SSE2
+namespace _DerivPrivate {
+//applies an operation to each pair of partials; recursive like VecOp so that it is always unrolled
+template<int Pairs>
+struct SimdOp
+{
+    template<class F> static void apply(const F &func, const __m128d *a, const __m128d *b, __m128d *out)
+    { out[Pairs - 1] = func(a[Pairs - 1], b[Pairs - 1]); SimdOp<Pairs - 1>::apply(func, a, b, out); }
+};
+
+template<>
+struct SimdOp<0>
+{
+    template<class F> static void apply(const F &, const __m128d *, const __m128d *, __m128d *) {}
+};
+
+struct SimdAdd { __m128d operator()(__m128d a, __m128d b) const { return _mm_add_pd(a, b); } };
+struct SimdSub { __m128d operator()(__m128d a, __m128d b) const { return _mm_sub_pd(a, b); } };
+struct SimdMul
+{
+    SimdMul(double inS) : s(_mm_set1_pd(inS)) {}
+    __m128d operator()(__m128d a, __m128d) const { return _mm_mul_pd(a, s); }
+    __m128d s;
+};
+struct SimdDiv
+{
+    SimdDiv(double inS) : s(_mm_set1_pd(inS)) {}
+    __m128d operator()(__m128d a, __m128d) const { return _mm_div_pd(a, s); }
+    __m128d s;
+};
+struct SimdCombine //a * sa + b * sb
+{
+    SimdCombine(double inSA, double inSB) : sa(_mm_set1_pd(inSA)), sb(_mm_set1_pd(inSB)) {}
+    __m128d operator()(__m128d a, __m128d b) const { return _mm_add_pd(_mm_mul_pd(a, sa), _mm_mul_pd(b, sb)); }
+    __m128d sa, sb;
+};
+} //namespace _DerivPrivate
+
+template<int Vars>
+class DerivSimd
+{
+public:
+    typedef DerivSimd<Vars> Self;
+
+    DerivSimd() { int i; for(i = 0; i < pairs; ++i) v[i] = _mm_setzero_pd(); }
+    DerivSimd(const Vector<double, Vars> &other)
+    {
+        int i;
+        for(i = 0; i < pairs; ++i)
+            v[i] = _mm_set_pd(2 * i + 1 < Vars ? other[2 * i + 1] : 0., other[2 * i]);
+    }
+
+    double &operator[](int n) { return reinterpret_cast<double *>(v)[n]; }
+    const double &operator[](int n) const { return reinterpret_cast<const double *>(v)[n]; }
+    operator Vector<double, Vars>() const
+    { int i; Vector<double, Vars> out; for(i = 0; i < Vars; ++i) out[i] = (*this)[i]; return out; }
+
+    Self operator+(const Self &other) const { return op(_DerivPrivate::SimdAdd(), other); }
+    Self operator-(const Self &other) const { return op(_DerivPrivate::SimdSub(), other); }
+    Self operator*(const double &scalar) const { return op(_DerivPrivate::SimdMul(scalar), *this); }
+    Self operator/(const double &scalar) const { return op(_DerivPrivate::SimdDiv(scalar), *this); }
+    Self operator-() const { return Self().op(_DerivPrivate::SimdSub(), *this); }
+
+    Self &operator+=(const Self &other) { (*this) = (*this) + other; return *this; }
+    Self &operator-=(const Self &other) { (*this) = (*this) - other; return *this; }
+    Self &operator*=(const double &scalar) { (*this) = (*this) * scalar; return *this; }
+    Self &operator/=(const double &scalar) { (*this) = (*this) / scalar; return *this; }
+
+    //u * a + v * b, which is what the derivative of a product or of a two-variable function is
+    static Self combine(const double &a, const Self &u, const double &b, const Self &v)
+    { return u.op(_DerivPrivate::SimdCombine(a, b), v); }
+
+    int size() const { return Vars; }
+
+private:
+    static const int pairs = (Vars + 1) / 2;
+
+    explicit DerivSimd(int) {} //uninitialized, for results
+
+    template<class F> Self op(const F &func, const Self &other) const
+    { Self out(0); _DerivPrivate::SimdOp<pairs>::apply(func, v, other.v, out.v); return out; }
+
+    __m128d v[pairs]; //for an odd number of variables, the last one is padded with a zero
+};
+
+template<int Vars>
+DerivSimd<Vars> operator*(const double &scalar, const DerivSimd<Vars> &d) { return d * scalar; }
+
+template <class charT, class traits, int Vars>
+basic_ostream<charT,traits>& operator<<(basic_ostream<charT,traits>& os, const DerivSimd<Vars> &d)
+{
+    os << Vector<double, Vars>(d);
+    return os;
+}
+
+template<> struct DerivPartials<double, 3> { typedef DerivSimd<3> Type; };
+template<> struct DerivPartials<double, 4> { typedef DerivSimd<4> Type; };
+template<> struct DerivPartials<double, 6> { typedef DerivSimd<6> Type; };
+template<> struct DerivPartials<double, 8> { typedef DerivSimd<8> Type; };
+
+#endif //DERIV_SSE2
+
+namespace _DerivPrivate {
+//a * u + b * v for either kind of partials
+template<class Partials, class Real>
+Partials combine(const Real &a, const Partials &u, const Real &b, const Partials &v) { return u * a + v * b; }
+
+#ifdef DERIV_SSE2
+template<int Vars>
+DerivSimd<Vars> combine(const double &a, const DerivSimd<Vars> &u, const double &b, const DerivSimd<Vars> &v)
+{ return DerivSimd<Vars>::combine(a, u, b, v); }
+#endif
+} //namespace _DerivPrivate
+
 template<class Real, int Vars>
 class Deriv
 {
 public:
     typedef Deriv<Real, Vars> Self;
+    typedef typename DerivPartials<Real, Vars>::Type Partials;
     
     Deriv() : x(Real()) {}
     Deriv(const Real &inX) : x(inX) {}
     Deriv(const Real &inX, int varNum) : x(inX) { d[varNum] = Real(1.); }
     Deriv(const Self &inD) : x(inD.x), d(inD.d) {}
     Deriv(const Real &inX, const Vector<Real, Vars> &inD) : x(inX), d(inD) {}
+    Deriv(const Real &inX, const Partials &inD, int) : x(inX), d(inD) {} //for internal use
     
     Real getReal() const { return x; }
     Real getDeriv(int num = 0) const { return d[num]; }
     
-    Self operator*(const Self &other) const { return Self(x * other.x, x * other.d + other.x * d); }
-    Self operator+(const Self &other) const { return Self(x + other.x, d + other.d); }
-    Self operator-(const Self &other) const { return Self(x - other.x, d - other.d); }
-    Self operator/(const Self &other) const { return Self(x / other.x, (other.x * d - x * other.d) / SQR(other.x)); }
-    Self operator-() const { return Self(-x, -d); }
+    Self operator*(const Self &other) const
+    { return Self(x * other.x, _DerivPrivate::combine(x, other.d, other.x, d), 0); }
+    Self operator+(const Self &other) const { return Self(x + other.x, d + other.d, 0); }
+    Self operator-(const Self &other) const { return Self(x - other.x, d - other.d, 0); }
+    Self operator/(const Self &other) const
+    { return Self(x / other.x, _DerivPrivate::combine(other.x, d, -x, other.d) / SQR(other.x), 0); }
+    Self operator-() const { return Self(-x, -d, 0); }
     Self &operator+=(const Self &other) { x += other.x; d += other.d; return *this; }
     Self &operator-=(const Self &other) { x -= other.x; d -= other.d; return *this; }
     Self &operator*=(const Self &other) { (*this) = (*this) * other; return *this; }
@@ -57,17 +186,17 @@ public:
     
     //for internal use
     const Real &_x() const { return x; }
-    const Vector<Real, Vars> &_d() const { return d; }
+    const Partials &_d() const { return d; }
         
 private:
     
     Real x;
-    Vector<Real, Vars> d;
+    Partials d;
 };
 
 #define DerivRV Deriv<Real, Vars>
 #define ONEVAR(func, deriv) template<class Real, int Vars> \
-    DerivRV func(const DerivRV &x) { return DerivRV(func(x._x()), x._d() * (deriv)); }
+    DerivRV func(const DerivRV &x) { return DerivRV(func(x._x()), x._d() * Real(deriv), 0); }
 
 ONEVAR(sqrt, Real(0.5) / sqrt(x._x()))
 ONEVAR(log, Real(1.) / x._x())
@@ -83,7 +212,8 @@ ONEVAR(fabs, x._x() < Real(0.) ? Real(-1.) : Real(1.))
 
 #undef ONEVAR
 #define TWOVAR(func, derivx, derivy) template<class Real, int Vars> \
-DerivRV func(const DerivRV &x, const DerivRV &y) { return DerivRV(func(x._x(), y._x()), x._d() * (derivx) + y._d() * (derivy)); }
+DerivRV func(const DerivRV &x, const DerivRV &y) \
+{ return DerivRV(func(x._x(), y._x()), _DerivPrivate::combine(Real(derivx), x._d(), Real(derivy), y._d()), 0); }
 
 TWOVAR(pow, y._x() * pow(x._x(), y._x() - Real(1.)), log(x._x()) * pow(x._x(), y._x()))
 TWOVAR(atan2, y._x() / (SQR(x._x()) + SQR(y._x())), -x._x() / (SQR(x._x()) + SQR(y._x())))
@@ -98,4 +228,155 @@ basic_ostream<charT,traits>& operator<<(basic_ostream<charT,traits>& os, const D
     return os;
 }
 
+//Reverse mode: operations on RDeriv values are recorded on a Tape, and the derivatives of one
+//result with respect to all of the variables are then computed in a single backward sweep, for
+//a small constant multiple of the cost of computing the result.  Constants (RDeriv's made from a
+//Real) are not recorded.  clear() keeps the tape's storage for the next evaluation.
+template<class Real> class RDeriv;
+
+template<class Real>
+class Tape
+{
+public:
+    typedef RDeriv<Real> Value;
+
+    Value variable(const Real &x) //variables are numbered in the order they are made
+    {
+        vars.push_back(push(-1, Real(), -1, Real()));
+        return Value(x, vars.back(), this);
+    }
+
+    void clear() { nodes.clear(); vars.clear(); adjoints.clear(); }
+
+    //computes the derivatives of out, which are then returned by getDeriv
+    void gradient(const Value &out)
+    {
+        adjoints.assign(nodes.size(), Real());
+        if(out._idx() < 0)
+            return;
+        adjoints[out._idx()] = Real(1.);
+        for(int i = out._idx(); i >= 0; --i) {
+            const Node &n = nodes[i];
+            Real adj = adjoints[i];
+            if(adj == Real())
+                continue;
+            if(n.a >= 0)
+                adjoints[n.a] += n.da * adj;
+            if(n.b >= 0)
+                adjoints[n.b] += n.db * adj;
+        }
+    }
+
+    Real getDeriv(int varNum) const { return adjoints.empty() ? Real() : adjoints[vars[varNum]]; }
+    int size() const { return nodes.size(); }
+
+    //for internal use: records a value depending on nodes a and b (-1 for none) with the given partials
+    int push(int a, const Real &da, int b, const Real &db)
+    {
+        Node n = { a, b, da, db };
+        nodes.push_back(n);
+        return nodes.size() - 1;
+    }
+
+private:
+    struct Node
+    {
+        int a, b;
+        Real da, db;
+    };
+
+    vector<Node> nodes;
+    vector<int> vars;
+    vector<Real> adjoints;
+};
+
+template<class Real>
+class RDeriv
+{
+public:
+    typedef RDeriv<Real> Self;
+
+    RDeriv() : x(Real()), idx(-1), tape(NULL) {}
+    RDeriv(const Real &inX) : x(inX), idx(-1), tape(NULL) {}
+    RDeriv(const Real &inX, int inIdx, Tape<Real> *inTape) : x(inX), idx(inIdx), tape(inTape) {}
+
+    Real getReal() const { return x; }
+
+    Self operator*(const Self &other) const { return _binary(x * other.x, other.x, other, x); }
+    Self operator+(const Self &other) const { return _binary(x + other.x, Real(1.), other, Real(1.)); }
+    Self operator-(const Self &other) const { return _binary(x - other.x, Real(1.), other, Real(-1.)); }
+    Self operator/(const Self &other) const
+    { return _binary(x / other.x, Real(1.) / other.x, other, -x / SQR(other.x)); }
+    Self operator-() const { return _unary(-x, Real(-1.)); }
+    Self &operator+=(const Self &other) { (*this) = (*this) + other; return *this; }
+    Self &operator-=(const Self &other) { (*this) = (*this) - other; return *this; }
+    Self &operator*=(const Self &other) { (*this) = (*this) * other; return *this; }
+    Self &operator/=(const Self &other) { (*this) = (*this) / other; return *this; }
+
+    bool operator<(const Self &other) const { return x < other.x; }
+    bool operator<=(const Self &other) const { return x <= other.x; }
+    bool operator>(const Self &other) const { return x > other.x; }
+    bool operator>=(const Self &other) const { return x >= other.x; }
+    bool operator==(const Self &other) const { return x == other.x; }
+    bool operator!=(const Self &other) const { return x != other.x; }
+
+    operator Real() const { return x; }
+
+    //for internal use
+    const Real &_x() const { return x; }
+    int _idx() const { return idx; }
+    Self _unary(const Real &value, const Real &deriv) const
+    {
+        if(idx < 0)
+            return Self(value);
+        return Self(value, tape->push(idx, deriv, -1, Real()), tape);
+    }
+    Self _binary(const Real &value, const Real &deriv, const Self &other, const Real &otherDeriv) const
+    {
+        if(other.idx < 0)
+            return _unary(value, deriv);
+        if(idx < 0)
+            return other._unary(value, otherDeriv);
+        return Self(value, tape->push(idx, deriv, other.idx, otherDeriv), tape);
+    }
+
+private:
+    Real x;
+    int idx; //on the tape, -1 for constants
+    Tape<Real> *tape;
+};
+
+#define RDerivR RDeriv<Real>
+#define ONEVAR(func, deriv) template<class Real> \
+    RDerivR func(const RDerivR &x) { return x._unary(func(x._x()), deriv); }
+
+ONEVAR(sqrt, Real(0.5) / sqrt(x._x()))
+ONEVAR(log, Real(1.) / x._x())
+ONEVAR(log10, Real(0.43429448190325182765) / x._x()) //the number is 1 / log(10)
+ONEVAR(exp, exp(x._x()))
+ONEVAR(sin, cos(x._x()))
+ONEVAR(cos, -sin(x._x()))
+ONEVAR(tan, Real(1.) / SQR(cos(x._x())))
+ONEVAR(acos, Real(-1.) / sqrt(Real(1. - SQR(x._x()))))
+ONEVAR(asin, Real(1.) / sqrt(Real(1. - SQR(x._x()))))
+ONEVAR(atan, Real(1.) / (Real(1.) + SQR(x._x())))
+ONEVAR(fabs, x._x() < Real(0.) ? Real(-1.) : Real(1.))
+
+#undef ONEVAR
+#define TWOVAR(func, derivx, derivy) template<class Real> \
+RDerivR func(const RDerivR &x, const RDerivR &y) { return x._binary(func(x._x(), y._x()), derivx, y, derivy); }
+
+TWOVAR(pow, y._x() * pow(x._x(), y._x() - Real(1.)), log(x._x()) * pow(x._x(), y._x()))
+TWOVAR(atan2, y._x() / (SQR(x._x()) + SQR(y._x())), -x._x() / (SQR(x._x()) + SQR(y._x())))
+
+#undef TWOVAR
+#undef RDerivR
+
+template <class charT, class traits, class Real>
+basic_ostream<charT,traits>& operator<<(basic_ostream<charT,traits>& os, const RDeriv<Real> &d)
+{
+    os << "RDeriv(" << d._x() << ")";
+    return os;
+}
+
 #endif //DERIV_H_INCLUDED
@@ -19,6 +19,10 @@
 #include "pinocchioApi.h"
 #include "deriv.h"
 #include "debugging.h"
+#include "delaunay.h"
+#include "timer.h"
+#include <queue>
+#include <set>
 
 //fits mesh inside unit cube, makes sure there's exactly one connected component
 Mesh  prepareMesh(const Mesh &m)
@@ -64,17 +68,11 @@ double getMinDot(TreeType *distanceField, const Vector3 &c, double step)
     typedef Vector<D, 3> VD;
     
     int i, j;
-    vector<Vector3> vecs;
-    vecs.push_back(Vector3(step, step, step));
-    vecs.push_back(Vector3(step, step, -step));
-    vecs.push_back(Vector3(step, -step, step));
-    vecs.push_back(Vector3(step, -step, -step));
-    vecs.push_back(Vector3(-step, step, step));
-    vecs.push_back(Vector3(-step, step, -step));
-    vecs.push_back(Vector3(-step, -step, step));
-    vecs.push_back(Vector3(-step, -step, -step));
+    Vector3 vecs[8];
+    for(i = 0; i < 8; ++i)
+        vecs[i] = Vector3((i & 4) ? -step : step, (i & 2) ? -step : step, (i & 1) ? -step : step);
     
-    for(i = 0; i < (int)vecs.size(); ++i) {
+    for(i = 0; i < 8; ++i) {
         vecs[i] += c;
         VD vd = VD(D(vecs[i][0], 0), D(vecs[i][1], 1), D(vecs[i][2], 2));
         
@@ -84,145 +82,592 @@ double getMinDot(TreeType *distanceField, const Vector3 &c, double step)
     
     double minDot = 1.;
     
-    for(i = 1; i < (int)vecs.size(); ++i) for(j = 0; j < i; ++j) {
+    for(i = 1; i < 8; ++i) for(j = 0; j < i; ++j) {
         minDot = min(minDot, vecs[i] * vecs[j]);
     }
     
     return minDot;
 }
 
-bool sphereComp(const Sphere &s1, const Sphere &s2) { return s1.radius > s2.radius; }
+//samples are ordered by radius in decreasing order, ties broken by position so that
+//the order does not depend on the order in which they were found
+bool sphereComp(const Sphere &s1, const Sphere &s2)
+{
+    if(s1.radius != s2.radius)
+        return s1.radius > s2.radius;
+    for(int i = 0; i < 3; ++i)
+        if(s1.center[i] != s2.center[i])
+            return s1.center[i] < s2.center[i];
+    return false;
+}
+
+static bool sameCenter(const Sphere &s1, const Sphere &s2) { return s1.center == s2.center; }
+
+static bool centerLess(const Vector3 &c1, const Vector3 &c2)
+{
+    for(int i = 0; i < 3; ++i)
+        if(c1[i] != c2[i])
+            return c1[i] < c2[i];
+    return false;
+}
+
+//the leaf whose half-open box [lo, hi) contains v
+static OctTreeNode *halfOpenLeaf(OctTreeNode *node, const Vector3 &v)
+{
+    while(node->getChild(0)) {
+        Vector3 center = node->getRect().getCenter();
+        int idx = 0;
+        for(int i = 0; i < 3; ++i)
+            if(v[i] >= center[i])
+                idx += (1 << i);
+        node = node->getChild(idx);
+    }
+    return node;
+}
+
+//whether the grid (spacing step) on the three lo faces of the leaf contains v
+static bool onFaceGrid(OctTreeNode *leaf, const Vector3 &v, double step)
+{
+    const double eps = 1e-12;
+    Rect3 r = leaf->getRect();
+    double sz = r.getSize()[0];
+    bool onFace = false;
+    for(int i = 0; i < 3; ++i) {
+        double off = v[i] - r.getLo()[i];
+        if(off < -eps || off > sz + eps)
+            return false;
+        if(fabs(off - step * floor(off / step + 0.5)) > eps)
+            return false;
+        if(fabs(off) <= eps)
+            onFace = true;
+    }
+    return onFace;
+}
+
+//evaluates a face grid point of a medial leaf and appends it to out if it is a medial sample
+static void sampleMedialPoint(TreeType *distanceField, const Vector3 &p, double step, vector<Sphere> &out)
+{
+    double dist = -distanceField->locate(p)->evaluate(p);
+    if(dist <= 2. * step)
+        return; //we want to be well inside
+    double dot = getMinDot(distanceField, p, step * 0.001);
+    if(dot > 0.0)
+        return;
+    out.push_back(Sphere(p, dist));
+}
+
+//whether an octree leaf is likely near the medial surface
+static bool isMedialLeaf(TreeType *distanceField, OctTreeNode *leaf)
+{
+    Rect3 r = leaf->getRect();
+    double rad = r.getSize().length() / 2.;
+    return getMinDot(distanceField, r.getCenter(), rad) <= 0.;
+}
+
+//medial flags precomputed for a list of leaves
+class MedialFlags
+{
+public:
+    MedialFlags(const hash_map<OctTreeNode *, int> &inLeafIdx, const vector<char> &inMedial)
+        : leafIdx(inLeafIdx), medial(inMedial) {}
+
+    bool operator()(OctTreeNode *leaf) const { return medial[leafIdx.find(leaf)->second] != 0; }
+
+private:
+    const hash_map<OctTreeNode *, int> &leafIdx;
+    const vector<char> &medial;
+};
+
+//medial flags computed as leaves are asked about (by any thread)
+class LazyMedialFlags
+{
+public:
+    LazyMedialFlags(TreeType *inDistanceField) : distanceField(inDistanceField) {}
+
+    bool operator()(OctTreeNode *leaf)
+    {
+        bool found = false, out = false;
+#pragma omp critical(lazyMedialFlags)
+        {
+            hash_map<OctTreeNode *, bool>::iterator it = known.find(leaf);
+            if(it != known.end()) {
+                found = true;
+                out = it->second;
+            }
+        }
+        if(found)
+            return out;
+
+        out = isMedialLeaf(distanceField, leaf);
+#pragma omp critical(lazyMedialFlags)
+        known[leaf] = out;
+        return out;
+    }
+
+private:
+    TreeType *distanceField;
+    hash_map<OctTreeNode *, bool> known;
+};
+
+//Samples a grid on 3 of the faces of a medial leaf (that's enough).  A point on the far side of
+//the leaf belongs to the leaf whose half-open box contains it; if that leaf is medial and has the
+//point on its own grid, it is left to that leaf.
+template<class IsMedial>
+static void sampleMedialLeaf(TreeType *distanceField, OctTreeNode *leaf, double step, IsMedial &isMedial,
+                             vector<Sphere> &out)
+{
+    Rect3 r = leaf->getRect();
+    double x, y;
+    double sz = r.getSize()[0];
+    for(x = 0; x <= sz; x += step) for(y = 0; y <= sz; y += step) {
+        Vector3 face[3] = { r.getLo() + Vector3(x, y, 0), r.getLo() + Vector3(x, 0, y),
+                            r.getLo() + Vector3(0, x, y) };
+        int numFace = (y == 0.) ? 1 : ((x == 0.) ? 2 : 3);
+        for(int k = 0; k < numFace; ++k) {
+            if(x >= sz || y >= sz) {
+                OctTreeNode *owner = halfOpenLeaf(distanceField, face[k]);
+                if(owner != leaf && isMedial(owner) && onFaceGrid(owner, face[k], step))
+                    continue;
+            }
+            sampleMedialPoint(distanceField, face[k], step, out);
+        }
+    }
+}
 
 //samples the distance field to find spheres on the medial surface
 //output is sorted by radius in decreasing order
 vector<Sphere> sampleMedialSurface(TreeType *distanceField, double tol)
 {
     int i;
-    vector<Sphere> out;
 
-    vector<OctTreeNode *> todo;
-    todo.push_back(distanceField);
-    int inTodo = 0;
-    while(inTodo < (int)todo.size()) {
-        OctTreeNode *cur = todo[inTodo];
-        ++inTodo;
+    //flatten the leaves
+    vector<OctTreeNode *> leaves, todo(1, distanceField);
+    while(!todo.empty()) {
+        OctTreeNode *cur = todo.back();
+        todo.pop_back();
         if(cur->getChild(0)) {
-            for(i = 0; i < 8; ++i) {
+            for(i = 0; i < 8; ++i)
                 todo.push_back(cur->getChild(i));
-            }
-            continue;
         }
-        
-        //we are at octree leaf
-        Rect3 r = cur->getRect();
-        double rad = r.getSize().length() / 2.;
-        Vector3 c = r.getCenter();
-        double dot = getMinDot(distanceField, c, rad);
-        if(dot > 0.)
-            continue;
-    
-        //we are likely near medial surface
-        double step = tol;
-        double x, y;
-        vector<Vector3> pts;
-        double sz = r.getSize()[0];
-        for(x = 0; x <= sz; x += step) for(y = 0; y <= sz; y += step) {
-            pts.push_back(r.getLo() + Vector3(x, y, 0));
-            if(y != 0.)
-                pts.push_back(r.getLo() + Vector3(x, 0, y));
-            if(x != 0. && y != 0.)
-                pts.push_back(r.getLo() + Vector3(0, x, y));
+        else
+            leaves.push_back(cur);
+    }
+
+    int numLeaves = leaves.size();
+    hash_map<OctTreeNode *, int> leafIdx;
+    for(i = 0; i < numLeaves; ++i)
+        leafIdx[leaves[i]] = i;
+
+    //mark the leaves that are likely near the medial surface
+    vector<char> medial(numLeaves);
+#pragma omp parallel for schedule(dynamic, 64)
+    for(i = 0; i < numLeaves; ++i)
+        medial[i] = isMedialLeaf(distanceField, leaves[i]);
+
+    //sample the medial leaves--each thread collects and sorts its own samples
+    vector<vector<Sphere> > buffers;
+#pragma omp parallel
+    {
+        vector<Sphere> buffer;
+        MedialFlags isMedial(leafIdx, medial);
+
+#pragma omp for schedule(dynamic, 16) nowait
+        for(i = 0; i < numLeaves; ++i) {
+            if(medial[i])
+                sampleMedialLeaf(distanceField, leaves[i], tol, isMedial, buffer);
         }
-        
-        //pts now contains a grid on 3 of the octree cell faces (that's enough)
-        for(i = 0; i < (int)pts.size(); ++i) {
-            Vector3 &p = pts[i];
-            double dist = -distanceField->locate(p)->evaluate(p);
-            if(dist <= 2. * step)
-                continue; //we want to be well inside
-            double dot = getMinDot(distanceField, p, step * 0.001);
-            if(dot > 0.0)
-                continue;
-            out.push_back(Sphere(p, dist));
+
+        sort(buffer.begin(), buffer.end(), sphereComp);
+#pragma omp critical
+        buffers.push_back(buffer);
+    }
+
+    //merge the sorted buffers pairwise
+    int numBuffers = buffers.size();
+    for(int width = 1; width < numBuffers; width *= 2) {
+#pragma omp parallel for
+        for(i = 0; i < numBuffers - width; i += 2 * width) {
+            vector<Sphere> merged(buffers[i].size() + buffers[i + width].size());
+            merge(buffers[i].begin(), buffers[i].end(), buffers[i + width].begin(), buffers[i + width].end(),
+                  merged.begin(), sphereComp);
+            buffers[i].swap(merged);
+            vector<Sphere>().swap(buffers[i + width]);
         }
     }
-    
+
+    vector<Sphere> out;
+    if(numBuffers > 0)
+        out.swap(buffers[0]);
+
+    //points on grid lines shared by several leaves may still have been sampled more than once
+    out.erase(unique(out.begin(), out.end(), sameCenter), out.end());
+
     Debugging::out() << "Medial axis points = " << out.size() << endl;
-    
+
+    return out;
+}
+
+//An octree cell keyed by a bound on the distance values inside it: the distance at the center
+//plus the full diagonal, which leaves room for interpolation error and is no smaller than the
+//bound of any of the children.
+struct CellBound
+{
+    CellBound(TreeType *distanceField, OctTreeNode *inNode) : node(inNode)
+    {
+        Rect3 r = node->getRect();
+        Vector3 c = r.getCenter();
+        bound = -distanceField->locate(c)->evaluate(c) + r.getSize().length();
+    }
+
+    //ties are broken by position so that a sample budget gives the same samples every time
+    bool operator<(const CellBound &other) const
+    {
+        if(bound != other.bound)
+            return bound < other.bound;
+        Vector3 lo = node->getRect().getLo(), otherLo = other.node->getRect().getLo();
+        for(int i = 0; i < 3; ++i)
+            if(lo[i] != otherLo[i])
+                return lo[i] > otherLo[i];
+        return false;
+    }
+
+    double bound;
+    OctTreeNode *node;
+};
+
+vector<Sphere> sampleMedialSurface(TreeType *distanceField, const MedialBudget &budget, double tol)
+{
+    if(budget.maxSamples <= 0 && budget.maxSeconds <= 0.)
+        return sampleMedialSurface(distanceField, tol);
+
+    int i, j;
+    Timer timer;
+    vector<Sphere> out;
+    LazyMedialFlags isMedial(distanceField);
+
+    //Visit the leaves in decreasing order of the largest sphere they may contain until we run out
+    //of time or no remaining leaf can improve on the largest maxSamples radii found so far.  The
+    //leaves are taken a batch at a time and sampled in parallel.  The batches don't depend on the
+    //number of threads, so neither do the samples.
+    const int batchSize = 64;
+    int visited = 0, generated = 0;
+    priority_queue<double, vector<double>, greater<double> > largest; //of the distinct centers
+    set<Vector3, bool (*)(const Vector3 &, const Vector3 &)> centers(centerLess);
+    priority_queue<CellBound> todo;
+    todo.push(CellBound(distanceField, distanceField));
+    vector<OctTreeNode *> batch;
+    vector<vector<Sphere> > found;
+    while(!todo.empty()) {
+        if(budget.maxSeconds > 0. && timer.elapsed() >= budget.maxSeconds)
+            break;
+
+        batch.clear();
+        while(!todo.empty() && (int)batch.size() < batchSize) {
+            if(budget.maxSamples > 0 && (int)largest.size() >= budget.maxSamples && todo.top().bound <= largest.top())
+                break;
+            OctTreeNode *cur = todo.top().node;
+            todo.pop();
+            if(cur->getChild(0)) {
+                for(i = 0; i < 8; ++i)
+                    todo.push(CellBound(distanceField, cur->getChild(i)));
+            }
+            else
+                batch.push_back(cur);
+        }
+        if(batch.empty())
+            break;
+        visited += batch.size();
+
+        found.assign(batch.size(), vector<Sphere>());
+#pragma omp parallel for schedule(dynamic, 1)
+        for(i = 0; i < (int)batch.size(); ++i) {
+            if(isMedial(batch[i]))
+                sampleMedialLeaf(distanceField, batch[i], tol, isMedial, found[i]);
+        }
+
+        //points on grid lines shared by several leaves may be sampled more than once
+        for(i = 0; i < (int)batch.size(); ++i) {
+            generated += found[i].size();
+            for(j = 0; j < (int)found[i].size(); ++j) {
+                if(!centers.insert(found[i][j].center).second)
+                    continue;
+                out.push_back(found[i][j]);
+                if(budget.maxSamples <= 0)
+                    continue;
+                largest.push(found[i][j].radius);
+                if((int)largest.size() > budget.maxSamples)
+                    largest.pop();
+            }
+        }
+    }
+
     sort(out.begin(), out.end(), sphereComp);
+    if(budget.maxSamples > 0 && (int)out.size() > budget.maxSamples)
+        out.resize(budget.maxSamples);
+
+    Debugging::out() << "Medial axis points = " << out.size() << " (generated " << generated << ", visited "
+                     << visited << " leaves in " << timer.elapsed() << "s)" << endl;
 
     return out;
 }
 
+//Hierarchy of hash grids over sphere centers: a sphere of radius r goes into the finest level
+//whose cells are at least r across, so any point within r of its center is in one of the 27 cells
+//around the point's own cell on that level.  Out of range cells wrap around, which only costs
+//extra candidates.
+class SphereGrid
+{
+public:
+    SphereGrid(double maxRadius) : levels(1)
+    {
+        topSize = max(maxRadius, 4. / double(1 << gridBits));
+        while(levels < 16 && double(1 << levels) / topSize < double(1 << gridBits))
+            ++levels;
+        grids.resize(levels);
+    }
+
+    int numLevels() const { return levels; }
+    double cellSize(int level) const { return topSize / double(1 << level); }
+
+    int levelFor(double radius) const
+    {
+        int level = 0;
+        while(level + 1 < levels && radius <= cellSize(level + 1))
+            ++level;
+        return level;
+    }
+
+    void add(const Sphere &s, int idx)
+    {
+        int level = levelFor(s.radius);
+        double size = cellSize(level);
+        grids[level][key(cell(s.center[0], size), cell(s.center[1], size), cell(s.center[2], size))].push_back(idx);
+    }
+
+    //appends indices of spheres stored on the given level within range cells of pt's cell
+    void getNear(const Vector3 &pt, int level, int range, vector<int> &out) const
+    {
+        const hash_map<int, vector<int> > &grid = grids[level];
+        if(grid.empty())
+            return;
+        double size = cellSize(level);
+        int cx = cell(pt[0], size), cy = cell(pt[1], size), cz = cell(pt[2], size);
+        for(int x = cx - range; x <= cx + range; ++x) for(int y = cy - range; y <= cy + range; ++y)
+            for(int z = cz - range; z <= cz + range; ++z) {
+                hash_map<int, vector<int> >::const_iterator it = grid.find(key(x, y, z));
+                if(it != grid.end())
+                    out.insert(out.end(), it->second.begin(), it->second.end());
+            }
+    }
+
+private:
+    static const int gridBits = 10;
+    static int cell(double coord, double size) { return (int)floor(coord / size); }
+    static int key(int x, int y, int z)
+    {
+        static const int mask = (1 << gridBits) - 1;
+        return (x & mask) + ((y & mask) << gridBits) + ((z & mask) << (2 * gridBits));
+    }
+
+    int levels;
+    double topSize;
+    vector<hash_map<int, vector<int> > > grids;
+};
+
 //takes sorted medial surface samples and sparsifies the vector
 vector<Sphere> packSpheres(const vector<Sphere> &samples, int maxSpheres)
 {
     int i, j;
     vector<Sphere> out;
 
+    if(samples.empty())
+        return out;
+
+    SphereGrid grid(samples[0].radius); //samples are sorted, so the first radius bounds the rest
+    vector<int> near;
+
     for(i = 0; i < (int)samples.size(); ++i) {
-        for(j = 0; j < (int)out.size(); ++j) {
-            if((out[j].center - samples[i].center).lengthsq() < SQR(out[j].radius))
+        const Vector3 &c = samples[i].center;
+        bool covered = false;
+        for(int level = 0; level < grid.numLevels() && !covered; ++level) {
+            near.clear();
+            grid.getNear(c, level, 1, near);
+            for(j = 0; j < (int)near.size(); ++j) {
+                if((out[near[j]].center - c).lengthsq() < SQR(out[near[j]].radius)) {
+                    covered = true;
                     break;
+                }
+            }
         }
-        if(j < (int)out.size())
+        if(covered)
             continue;
 
+        grid.add(samples[i], out.size());
         out.push_back(samples[i]);
         if((int)out.size() > maxSpheres)
             break;
     }
 
+    //how much of the medial sampling was actually needed
+    int used = min(i + 1, (int)samples.size());
+    Debugging::out() << "Packed spheres = " << out.size() << " (from " << used << " of "
+                     << samples.size() << " samples)" << endl;
+
     return out;
 }
 
-double getMaxDist(TreeType *distanceField, const Vector3 &v1, const Vector3 &v2, double maxAllowed)
+//Whether the distance field is below maxAllowed at all 101 evenly spaced points on the segment.
+//Inside an octree leaf, the field is a convex combination of the leaf's corner values, so if they
+//are all below maxAllowed, the samples strictly inside the leaf can be skipped.
+bool staysBelow(TreeType *distanceField, const Vector3 &v1, const Vector3 &v2, double maxAllowed)
 {
-    double maxDist = -1e37;
+    int i;
     Vector3 diff = (v2 - v1) / 100.;
-    for(int k = 0; k < 101; ++k) {
+    int k = 0;
+    while(true) {
         Vector3 pt = v1 + diff * double(k);
-        maxDist = max(maxDist, distanceField->locate(pt)->evaluate(pt));
-        if(maxDist > maxAllowed)
-            break;
+        DistData<3>::NodeType *leaf = distanceField->locate(pt);
+        if(leaf->evaluate(pt) >= maxAllowed)
+            return false;
+        if(k == 100)
+            return true;
+
+        int next = k + 1;
+        double maxCorner = -1e37;
+        for(i = 0; i < 8; ++i)
+            maxCorner = max(maxCorner, leaf->getValue(i));
+        if(maxCorner < maxAllowed) {
+            //where the segment leaves the leaf, in steps (with a margin for roundoff)
+            const Rect3 &rect = leaf->getRect();
+            double exit = 100.;
+            for(i = 0; i < 3; ++i) {
+                if(diff[i] > 0.)
+                    exit = min(exit, (rect.getHi()[i] - v1[i]) / diff[i]);
+                else if(diff[i] < 0.)
+                    exit = min(exit, (rect.getLo()[i] - v1[i]) / diff[i]);
+            }
+            next = max(next, (int)ceil(exit - 1e-6));
+        }
+        k = min(100, next);
     }
-    return maxDist;
 }
 
 //constructs graph on packed sphere centers
+//Spheres that intersect are connected.  Otherwise, an edge must satisfy the Gabriel condition and
+//stay well inside the mesh.  Gabriel edges are a subset of Delaunay edges, and a point violating
+//the Gabriel condition for an edge would be closer to its midpoint than the endpoints are, so it
+//suffices to check the endpoints' Delaunay neighbors.
 PtGraph connectSamples(TreeType *distanceField, const vector<Sphere> &spheres)
 {
-    int i, j;
+    int i, j, k;
     PtGraph out;
 
     for(i = 0; i < (int)spheres.size(); ++i)
         out.verts.push_back(spheres[i].center);
     out.edges.resize(spheres.size());
-        
-    for(i = 1; i < (int)spheres.size(); ++i) for(j = 0; j < i; ++j) {
-        int k;
-        Vector3 ctr = (spheres[i].center + spheres[j].center) * 0.5;
-        double radsq = (spheres[i].center - spheres[j].center).lengthsq() * 0.25;
-        if(radsq < SQR(spheres[i].radius + spheres[j].radius) * 0.25) { //if spheres intersect, there should be an edge
-            out.edges[i].push_back(j);
-            out.edges[j].push_back(i);
-            continue;
-        }
-        for(k = 0; k < (int)spheres.size(); ++k) {
-            if(k == i || k == j)
+
+    if(spheres.empty())
+        return out;
+
+    //intersecting spheres--each pair is found from the smaller sphere, whose grid levels are finer
+    double maxRadius = 0.;
+    for(i = 0; i < (int)spheres.size(); ++i)
+        maxRadius = max(maxRadius, spheres[i].radius);
+    SphereGrid grid(maxRadius);
+    for(i = 0; i < (int)spheres.size(); ++i)
+        grid.add(spheres[i], i);
+
+    vector<int> near;
+    for(i = 0; i < (int)spheres.size(); ++i) {
+        near.clear();
+        int myLevel = grid.levelFor(spheres[i].radius);
+        for(int level = 0; level <= myLevel; ++level)
+            grid.getNear(spheres[i].center, level, 2, near);
+        for(j = 0; j < (int)near.size(); ++j) {
+            int oth = near[j];
+            if(spheres[oth].radius < spheres[i].radius || (spheres[oth].radius == spheres[i].radius && oth >= i))
                 continue;
-            if((spheres[k].center - ctr).lengthsq() < radsq)
-                break; //gabriel graph condition violation
+            double radsq = (spheres[i].center - spheres[oth].center).lengthsq() * 0.25;
+            if(radsq < SQR(spheres[i].radius + spheres[oth].radius) * 0.25) {
+                out.edges[i].push_back(oth);
+                out.edges[oth].push_back(i);
+            }
         }
-        if(k < (int)spheres.size())
-            continue;
-        //every point on edge should be at least this far in:
-        double maxAllowed = -.5 * min(spheres[i].radius, spheres[j].radius);
-        if(getMaxDist(distanceField, spheres[i].center, spheres[j].center, maxAllowed) < maxAllowed) {
-            out.edges[i].push_back(j);
-            out.edges[j].push_back(i);
+    }
+
+    //Gabriel edges that are not already there.  Medial samples lie on a lattice, so there are many
+    //cospherical configurations in which a Gabriel edge is only in some of the Delaunay
+    //tetrahedralizations--two-hop Delaunay pairs are also candidates to catch those.
+    //Vertices are processed in parallel; each one only records edges to lower-numbered vertices
+    //in its own list, and the lists are merged in order afterwards.
+    int sz = spheres.size();
+    vector<Vector3> centers(out.verts);
+    vector<vector<int> > delaunay = delaunayNeighbors(centers);
+    vector<vector<int> > found(sz);
+
+#pragma omp parallel private(j, k)
+    {
+        vector<int> candidates, mark(sz, -1);
+
+#pragma omp for schedule(dynamic, 16)
+        for(i = 0; i < sz; ++i) {
+            for(j = 0; j < (int)out.edges[i].size(); ++j)
+                mark[out.edges[i][j]] = i;
+            mark[i] = i;
+
+            candidates.clear();
+            for(j = 0; j < (int)delaunay[i].size(); ++j) {
+                int nb = delaunay[i][j];
+                if(mark[nb] != i && nb < i) {
+                    mark[nb] = i;
+                    candidates.push_back(nb);
+                }
+                for(k = 0; k < (int)delaunay[nb].size(); ++k) {
+                    int nb2 = delaunay[nb][k];
+                    if(mark[nb2] != i && nb2 < i) {
+                        mark[nb2] = i;
+                        candidates.push_back(nb2);
+                    }
+                }
+            }
+
+            for(j = 0; j < (int)candidates.size(); ++j) {
+                int oth = candidates[j];
+                Vector3 ctr = (spheres[i].center + spheres[oth].center) * 0.5;
+                double radsq = (spheres[i].center - spheres[oth].center).lengthsq() * 0.25;
+                bool gabriel = true;
+                for(int end = 0; end < 2 && gabriel; ++end) {
+                    const vector<int> &nb = delaunay[end == 0 ? i : oth];
+                    for(k = 0; k < (int)nb.size(); ++k) {
+                        if(nb[k] == i || nb[k] == oth)
+                            continue;
+                        if((spheres[nb[k]].center - ctr).lengthsq() < radsq) {
+                            gabriel = false; //gabriel graph condition violation
+                            break;
+                        }
+                    }
+                }
+                if(!gabriel)
+                    continue;
+
+                //every point on edge should be at least this far in:
+                double maxAllowed = -.5 * min(spheres[i].radius, spheres[oth].radius);
+                if(staysBelow(distanceField, spheres[i].center, spheres[oth].center, maxAllowed))
+                    found[i].push_back(oth);
+            }
+        }
+    }
+
+    for(i = 0; i < sz; ++i) {
+        for(j = 0; j < (int)found[i].size(); ++j) {
+            out.edges[i].push_back(found[i][j]);
+            out.edges[found[i][j]].push_back(i);
         }
     }
 
+    //same edge order as an all-pairs scan would produce
+    for(i = 0; i < (int)spheres.size(); ++i)
+        sort(out.edges[i].begin(), out.edges[i].end());
+
     return out;
 }
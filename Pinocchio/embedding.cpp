@@ -18,31 +18,191 @@
 
 #include "pinocchioApi.h"
 #include "debugging.h"
+#include "timer.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 struct FP //information for penalty functions
 {
-    FP(const PtGraph &inG, const Skeleton &inSk, const vector<Sphere> &inS)
-        : graph(inG), given(inSk), sph(inS), paths(inG) {}
+    FP(const PtGraph &inG, const Skeleton &inSk, const vector<Sphere> &inS, size_t pathCacheBytes = 0,
+       PathSplitCache *inSplitCache = NULL, const AllShortestPather *allPaths = NULL)
+        : graph(inG), given(inSk), sph(inS), paths(inG, pathCacheBytes, allPaths), splitCache(inSplitCache)
+    {
+        for(int i = 0; i < (int)graph.verts.size(); ++i) {
+            vertX.push_back(graph.verts[i][0]);
+            vertY.push_back(graph.verts[i][1]);
+            vertZ.push_back(graph.verts[i][2]);
+        }
+        for(int i = 0; i < (int)sph.size(); ++i)
+            radius.push_back(sph[i].radius);
+    }
 
     const PtGraph &graph;
     const Skeleton &given;
     const vector<Sphere> &sph;
-    AllShortestPather paths;
+    LazyShortestPather paths; //only distances from vertices that are actually queried get computed,
+                              //unless all of them were computed up front
+    PathSplitCache *splitCache; //may be NULL
     double footBase;
+
+    vector<double> vertX, vertY, vertZ, radius; //graph vertices and sphere radii by coordinate, for getMany
 };
 
+//the splits whose keys hash to one shard.  The vectors are never changed or freed while the cache lives,
+//so they can be copied out after the lock is released.
+struct PathSplitCache::Shard
+{
+    Shard() : hits(0), misses(0)
+    {
+#ifdef _OPENMP
+        omp_init_lock(&ompLock);
+#endif
+    }
+
+    ~Shard()
+    {
+        for(hash_map<pair<int, pair<int, int> >, vector<Vector3> *>::iterator it = splits.begin();
+            it != splits.end(); ++it)
+            delete it->second;
+#ifdef _OPENMP
+        omp_destroy_lock(&ompLock);
+#endif
+    }
+
+    void lock()
+    {
+#ifdef _OPENMP
+        omp_set_lock(&ompLock);
+#endif
+    }
+
+    void unlock()
+    {
+#ifdef _OPENMP
+        omp_unset_lock(&ompLock);
+#endif
+    }
+
+    hash_map<pair<int, pair<int, int> >, vector<Vector3> *> splits;
+    int hits, misses;
+#ifdef _OPENMP
+    omp_lock_t ompLock;
+#endif
+};
+
+static const int numSplitShards = 16;
+
+PathSplitCache::PathSplitCache()
+{
+    int i;
+    for(i = 0; i < numSplitShards; ++i)
+        shards.push_back(new Shard());
+}
+
+PathSplitCache::~PathSplitCache()
+{
+    int i;
+    for(i = 0; i < (int)shards.size(); ++i)
+        delete shards[i];
+}
+
+PathSplitCache::Shard &PathSplitCache::shardOf(int joint, int sphere, int parentSphere) const
+{
+    unsigned int h = (unsigned int)joint * 73856093u ^ (unsigned int)sphere * 19349663u ^
+                     (unsigned int)parentSphere * 83492791u;
+    return *shards[(h >> 8) % numSplitShards];
+}
+
+bool PathSplitCache::find(int joint, int sphere, int parentSphere, vector<Vector3> &pts) const
+{
+    Shard &shard = shardOf(joint, sphere, parentSphere);
+    const vector<Vector3> *found = NULL;
+
+    shard.lock();
+    hash_map<pair<int, pair<int, int> >, vector<Vector3> *>::const_iterator it =
+        shard.splits.find(make_pair(joint, make_pair(sphere, parentSphere)));
+    if(it != shard.splits.end()) {
+        found = it->second;
+        ++shard.hits;
+    }
+    else
+        ++shard.misses;
+    shard.unlock();
+
+    if(found == NULL)
+        return false;
+    pts = *found;
+    return true;
+}
+
+void PathSplitCache::insert(int joint, int sphere, int parentSphere, const vector<Vector3> &pts)
+{
+    Shard &shard = shardOf(joint, sphere, parentSphere);
+    vector<Vector3> *copy = new vector<Vector3>(pts);
+    bool inserted;
+
+    shard.lock();
+    inserted = shard.splits.insert(make_pair(make_pair(joint, make_pair(sphere, parentSphere)), copy)).second;
+    shard.unlock();
+
+    if(!inserted) //another thread got there first, with the same split
+        delete copy;
+}
+
+int PathSplitCache::getHits() const
+{
+    int i, out = 0;
+    for(i = 0; i < (int)shards.size(); ++i)
+        out += shards[i]->hits;
+    return out;
+}
+
+int PathSplitCache::getMisses() const
+{
+    int i, out = 0;
+    for(i = 0; i < (int)shards.size(); ++i)
+        out += shards[i]->misses;
+    return out;
+}
+
 struct PartialMatch
 {
-    PartialMatch(int vsz) : penalty(0), heuristic(0) { vTaken.resize(vsz, false); }
+    PartialMatch(int vsz) : penalty(0) { vTaken.resize(vsz, false); }
     
     vector<int> match;
     double penalty;
-    double heuristic;
-    bool operator<(const PartialMatch &pm) const { return heuristic > pm.heuristic; } //smallest penalty first
     
     vector<bool> vTaken;
 };
 
+//A node of the matching search: it extends its parent's match by assigning candidate to the next
+//joint, which takes the graph vertices takenVerts[takenStart..takenEnd) that were not already taken.
+//Full matches are only rebuilt for nodes that get expanded.
+struct SearchNode
+{
+    SearchNode(int inParent, int inSize, int inCandidate, double inPenalty, double inHeuristic,
+               int inTakenStart, int inTakenEnd)
+        : parent(inParent), size(inSize), candidate(inCandidate), penalty(inPenalty), heuristic(inHeuristic),
+          takenStart(inTakenStart), takenEnd(inTakenEnd) {}
+
+    int parent, size; //size is the number of matched joints
+    int candidate;
+    double penalty, heuristic;
+    int takenStart, takenEnd;
+};
+
+class SearchNodeOrder //for a priority queue of node indices: smallest heuristic first
+{
+public:
+    SearchNodeOrder(const vector<SearchNode> *inNodes) : nodes(inNodes) {}
+    bool operator()(int n1, int n2) const { return (*nodes)[n1].heuristic > (*nodes)[n2].heuristic; }
+
+private:
+    const vector<SearchNode> *nodes;
+};
+
 class PenaltyFunction
 {
 public:
@@ -50,6 +210,16 @@ public:
     virtual ~PenaltyFunction() {}
 
     virtual double get(const PartialMatch &cur, int next, int idx) const = 0;
+    //same as get for num candidates at once: out[i] = get(cur, next[i], idx)
+    virtual void getMany(const PartialMatch &cur, const int *next, int num, int idx, double *out) const
+    {
+        for(int i = 0; i < num; ++i)
+            out[i] = get(cur, next[i], idx);
+    }
+    virtual const char *getName() const = 0;
+    //whether get depends only on idx, next and the sphere matched to idx's parent (and not on the
+    //rest of the match), so that its values can be reused across partial matches
+    virtual bool isLocal() const { return false; }
 
     FP *fp;
     double weight;
@@ -110,121 +280,768 @@ vector<vector<int> > computePossibilities(const PtGraph &graph, const vector<Sph
 
 vector<PenaltyFunction *> getPenaltyFunctions(FP *fp); //user responsible for deletion of penalties
 
-double computePenalty(const vector<PenaltyFunction *> &penaltyFunctions,
-                      const PartialMatch &cur, int next, int idx = -1)
+//Computes the total penalty for matching sphere next to joint idx (by default, the next joint),
+//remembering the values of the local penalty functions by (idx, next, parent's sphere).  Also counts
+//calls to every function.
+class PenaltyTable
 {
-    if(idx == -1)
-        idx = cur.match.size();
-    if(idx == 0)
-        return 0;
+public:
+    PenaltyTable(const vector<PenaltyFunction *> &inFunctions, const Skeleton &inSkeleton, int inNumVerts)
+        : functions(inFunctions), skeleton(inSkeleton), numVerts(inNumVerts), calls(inFunctions.size(), 0), lookups(0), hits(0)
+    {
+        for(int i = 0; i < (int)functions.size(); ++i)
+            if(functions[i]->isLocal())
+                localIdx.push_back(i);
+    }
+
+    double compute(const PartialMatch &cur, int next, int idx = -1)
+    {
+        if(idx == -1)
+            idx = cur.match.size();
+        if(idx == 0)
+            return 0;
+
+        int offset = -1;
+        if(!localIdx.empty()) {
+            ++lookups;
+            pair<int, int> key(idx * numVerts + next, cur.match[skeleton.cPrev()[idx]]);
+            hash_map<pair<int, int>, int>::iterator it = offsets.find(key);
+            if(it != offsets.end()) {
+                ++hits;
+                offset = it->second;
+            }
+            else {
+                offset = values.size();
+                offsets[key] = offset;
+                values.resize(offset + functions.size());
+                known.resize(offset + functions.size(), false);
+            }
+        }
 
-    double out = 0.;
-    for(int i = 0; i < (int)penaltyFunctions.size(); ++i) {
-        double penalty = penaltyFunctions[i]->get(cur, next, idx) * penaltyFunctions[i]->weight;
-        if(penalty > 1.)
-            return 2.;
-        out += penalty;
+        double out = 0.;
+        for(int i = 0; i < (int)functions.size(); ++i) {
+            double penalty;
+            if(functions[i]->isLocal() && known[offset + i])
+                penalty = values[offset + i];
+            else {
+                ++calls[i];
+                penalty = functions[i]->get(cur, next, idx) * functions[i]->weight;
+                if(functions[i]->isLocal()) {
+                    values[offset + i] = penalty;
+                    known[offset + i] = true;
+                }
+            }
+            if(penalty > 1.)
+                return 2.;
+            out += penalty;
+        }
+        return out;
     }
-    return out;
-}
 
-vector<int> discreteEmbed(const PtGraph &graph, const vector<Sphere> &spheres,
-                          const Skeleton &skeleton, const vector<vector<int> > &possibilities)
+    //Same as compute for every sphere in cands, writing into out.  Each function scores all the
+    //candidates still in the running at once; a candidate drops out (with a total of 2) as soon as
+    //one of its penalties is over 1, which is applied as a mask rather than by branching.
+    void computeMany(const PartialMatch &cur, const vector<int> &cands, int idx, vector<double> &out)
+    {
+        int i, j, num = cands.size();
+        out.assign(num, 0.);
+        if(idx == 0)
+            return;
+
+        candOffset.resize(num);
+        if(!localIdx.empty()) {
+            lookups += num;
+            int parentSphere = cur.match[skeleton.cPrev()[idx]];
+            for(i = 0; i < num; ++i) {
+                pair<int, int> key(idx * numVerts + cands[i], parentSphere);
+                hash_map<pair<int, int>, int>::iterator it = offsets.find(key);
+                if(it != offsets.end()) {
+                    ++hits;
+                    candOffset[i] = it->second;
+                }
+                else {
+                    candOffset[i] = values.size();
+                    offsets[key] = values.size();
+                    values.resize(values.size() + functions.size());
+                    known.resize(values.size(), false);
+                }
+            }
+        }
+
+        alive.assign(num, 1);
+        current.resize(num);
+        for(j = 0; j < (int)functions.size(); ++j) {
+            bool local = functions[j]->isLocal();
+
+            //gather the candidates for which this function needs to be evaluated
+            todoCand.clear();
+            todoNext.clear();
+            for(i = 0; i < num; ++i) {
+                if(!alive[i])
+                    continue;
+                if(local && known[candOffset[i] + j])
+                    current[i] = values[candOffset[i] + j];
+                else {
+                    todoCand.push_back(i);
+                    todoNext.push_back(cands[i]);
+                }
+            }
+
+            int numTodo = todoCand.size();
+            if(numTodo > 0) {
+                evaluated.resize(numTodo);
+                functions[j]->getMany(cur, &(todoNext[0]), numTodo, idx, &(evaluated[0]));
+                calls[j] += numTodo;
+                for(i = 0; i < numTodo; ++i) {
+                    double penalty = evaluated[i] * functions[j]->weight;
+                    current[todoCand[i]] = penalty;
+                    if(local) {
+                        values[candOffset[todoCand[i]] + j] = penalty;
+                        known[candOffset[todoCand[i]] + j] = true;
+                    }
+                }
+            }
+
+            for(i = 0; i < num; ++i) {
+                bool over = alive[i] && current[i] > 1.;
+                out[i] = over ? 2. : (alive[i] ? out[i] + current[i] : out[i]);
+                alive[i] = alive[i] && !over;
+            }
+        }
+    }
+
+    int getCalls(int i) const { return calls[i]; }
+    int getLookups() const { return lookups; }
+    int getHits() const { return hits; }
+
+private:
+    const vector<PenaltyFunction *> &functions;
+    const Skeleton &skeleton;
+    vector<int> localIdx;
+    int numVerts;
+    hash_map<pair<int, int>, int> offsets;
+    vector<double> values;
+    vector<bool> known;
+    vector<int> calls;
+    int lookups, hits;
+
+    //scratch space for computeMany
+    vector<int> candOffset, todoCand, todoNext;
+    vector<char> alive;
+    vector<double> current, evaluated;
+};
+
+//Everything needed to score the children of search nodes.  There is one per thread, because the
+//shortest path cache and the penalty table fill up as they are used.
+struct Scorer
 {
-    int i, j;
-    FP fp(graph, skeleton, spheres);
+    Scorer(const PtGraph &graph, const vector<Sphere> &spheres, const Skeleton &skeleton, double footBase,
+           size_t pathCacheBytes, PathSplitCache *splitCache, const AllShortestPather *allPaths)
+        : fp(graph, skeleton, spheres, pathCacheBytes, splitCache, allPaths), functions(getPenaltyFunctions(&fp)),
+          penalties(functions, skeleton, graph.verts.size()), cur(graph.verts.size()), curNode(0)
+    {
+        fp.footBase = footBase;
+    }
 
-    fp.footBase = 1.;
-    for(i = 0; i < (int)graph.verts.size(); ++i)
-        fp.footBase = min(fp.footBase, graph.verts[i][1]);
+    ~Scorer()
+    {
+        for(int i = 0; i < (int)functions.size(); ++i)
+            delete functions[i];
+    }
+
+    //makes cur the match of node, clearing the taken vertices of the previous one
+    void rebuild(int node, const vector<SearchNode> &nodes, const vector<int> &takenVerts)
+    {
+        int i, j;
+        if(node == curNode)
+            return;
+        curNode = node;
+
+        for(i = 0; i < (int)chain.size(); ++i) {
+            for(j = nodes[chain[i]].takenStart; j < nodes[chain[i]].takenEnd; ++j)
+                cur.vTaken[takenVerts[j]] = false;
+        }
+        chain.clear();
+        for(i = node; i > 0; i = nodes[i].parent)
+            chain.push_back(i);
+        reverse(chain.begin(), chain.end());
+        cur.match.clear();
+        for(i = 0; i < (int)chain.size(); ++i) {
+            cur.match.push_back(nodes[chain[i]].candidate);
+            for(j = nodes[chain[i]].takenStart; j < nodes[chain[i]].takenEnd; ++j)
+                cur.vTaken[takenVerts[j]] = true;
+        }
+        cur.penalty = nodes[node].penalty;
+    }
+
+    //Scores matching candidate to the next joint of cur: returns false if the child is pruned.
+    //Otherwise sets its penalty and heuristic and appends the vertices it takes to taken.
+    //cur is extended in place and restored afterwards.
+    bool scoreChild(int candidate, const vector<vector<int> > &possibilities, double &penalty,
+                    double &heuristic, vector<int> &taken)
+    {
+        int j, k;
+        const Skeleton &skeleton = fp.given;
+        int idx = cur.match.size();
+        int toMatch = skeleton.cGraph().verts.size();
+
+        double extraPenalty = penalties.compute(cur, candidate);
+
+        if(extraPenalty < 0) {
+#pragma omp critical
+            Debugging::out() << "ERR = " << extraPenalty << endl;
+        }
+        if(cur.penalty + extraPenalty >= 1.)
+            return false;
+
+        double oldPenalty = cur.penalty;
+        penalty = cur.penalty + extraPenalty;
+        heuristic = penalty;
+
+        //compute taken vertices and edges
+        int takenStart = taken.size();
+        if(idx > 0) {
+            vector<int> path = fp.paths.path(candidate, cur.match[skeleton.cPrev()[idx]]);
+            for(j = 0; j < (int)path.size(); ++j) {
+                if(!cur.vTaken[path[j]]) {
+                    cur.vTaken[path[j]] = true;
+                    taken.push_back(path[j]);
+                }
+            }
+        }
+        cur.match.push_back(candidate);
+        cur.penalty = penalty;
+
+        //compute heuristic
+        for(j = idx + 1; j < toMatch; ++j) {
+            if(skeleton.cPrev()[j] > idx)
+                continue;
+            penalties.computeMany(cur, possibilities[j], j, candPenalties);
+            double minP = 1e37;
+            for(k = 0; k < (int)candPenalties.size(); ++k)
+                minP = min(minP, candPenalties[k]);
+            heuristic += minP;
+            if(heuristic > 1.)
+                break;
+        }
+
+        cur.match.pop_back();
+        cur.penalty = oldPenalty;
+        for(j = takenStart; j < (int)taken.size(); ++j)
+            cur.vTaken[taken[j]] = false;
+
+        if(heuristic > 1.) {
+            taken.resize(takenStart);
+            return false;
+        }
+        return true;
+    }
+
+    FP fp;
+    vector<PenaltyFunction *> functions;
+    PenaltyTable penalties;
+    PartialMatch cur;
+    vector<int> chain; //search nodes whose candidates make up cur
+    int curNode;
+    vector<int> taken; //vertices taken by the children scored in the current step
+    vector<double> candPenalties;
+};
+
+//a child of a node being expanded, as scored by one of the threads
+struct ChildScore
+{
+    ChildScore() : valid(false) {}
+
+    bool valid;
+    int scorer, takenStart, takenEnd;
+    double penalty, heuristic;
+};
+
+static const size_t defaultPathCacheBytes = 64 << 20; //see EmbedOptions::pathCacheBytes
 
-    vector<PenaltyFunction *> penaltyFunctions = getPenaltyFunctions(&fp);
+//the arena of search nodes and the scorers that expand them
+class MatchSearch
+{
+public:
+    MatchSearch(const PtGraph &graph, const vector<Sphere> &spheres, const Skeleton &skeleton,
+                const vector<vector<int> > &inPossibilities, const EmbedOptions &options)
+        : possibilities(inPossibilities), parallel(options.parallel || options.batchSize > 1),
+          splitCache(options.splitCache ? options.splitCache : &ownSplitCache), allPaths(NULL)
+    {
+        double footBase = 1.;
+        for(int i = 0; i < (int)graph.verts.size(); ++i)
+            footBase = min(footBase, graph.verts[i][1]);
+
+        int numScorers = 1;
+#ifdef _OPENMP
+        if(parallel)
+            numScorers = omp_get_max_threads();
+#endif
+        //if all the shortest paths fit in the cache, they are computed up front (in parallel) and shared
+        int sz = graph.verts.size();
+        size_t pathCacheBytes = options.pathCacheBytes > 0 ? options.pathCacheBytes : defaultPathCacheBytes;
+        if(AllShortestPather::matrixBytes(sz) <= pathCacheBytes)
+            allPaths = new AllShortestPather(graph);
+
+        for(int i = 0; i < numScorers; ++i)
+            scorers.push_back(new Scorer(graph, spheres, skeleton, footBase, pathCacheBytes, splitCache, allPaths));
+
+        nodes.push_back(SearchNode(-1, 0, -1, 0., 0., 0, 0)); //the empty match
+    }
+
+    ~MatchSearch()
+    {
+        for(int i = 0; i < (int)scorers.size(); ++i)
+            delete scorers[i];
+        delete allPaths;
+    }
+
+    //Scores all children of the batch nodes (in parallel) and adds the ones that aren't pruned to
+    //the arena, in order, so the search does not depend on the number of threads
+    void expand(const vector<int> &batch, vector<int> &added)
+    {
+        int i, j;
+        children.clear();
+        for(i = 0; i < (int)batch.size(); ++i) {
+            const vector<int> &cands = possibilities[nodes[batch[i]].size];
+            for(j = 0; j < (int)cands.size(); ++j)
+                children.push_back(make_pair(batch[i], cands[j]));
+        }
+        scores.assign(children.size(), ChildScore());
+
+#pragma omp parallel for schedule(dynamic, 4) if(parallel)
+        for(i = 0; i < (int)children.size(); ++i) {
+            int t = 0;
+#ifdef _OPENMP
+            t = omp_get_thread_num();
+#endif
+            Scorer &scorer = *(scorers[t]);
+            ChildScore &score = scores[i];
+            scorer.rebuild(children[i].first, nodes, takenVerts);
+            score.scorer = t;
+            score.takenStart = scorer.taken.size();
+            score.valid = scorer.scoreChild(children[i].second, possibilities, score.penalty, score.heuristic,
+                                            scorer.taken);
+            score.takenEnd = scorer.taken.size();
+        }
+
+        added.clear();
+        for(i = 0; i < (int)children.size(); ++i) {
+            const ChildScore &score = scores[i];
+            if(!score.valid)
+                continue;
+            const vector<int> &taken = scorers[score.scorer]->taken;
+            int takenStart = takenVerts.size();
+            takenVerts.insert(takenVerts.end(), taken.begin() + score.takenStart, taken.begin() + score.takenEnd);
+            nodes.push_back(SearchNode(children[i].first, nodes[children[i].first].size + 1, children[i].second,
+                                       score.penalty, score.heuristic, takenStart, takenVerts.size()));
+            added.push_back(nodes.size() - 1);
+        }
+        for(i = 0; i < (int)scorers.size(); ++i)
+            scorers[i]->taken.clear();
+    }
+
+    int getNumThreads() const { return scorers.size(); }
+
+    vector<int> getMatch(int node)
+    {
+        scorers[0]->rebuild(node, nodes, takenVerts);
+        return scorers[0]->cur.match;
+    }
+
+    void report() const
+    {
+        int i, j;
+        const Scorer &scorer = *(scorers[0]);
+        int pathHits = 0, pathMisses = 0, lookups = 0, hits = 0;
+        vector<int> calls(scorer.functions.size(), 0);
+        for(i = 0; i < (int)scorers.size(); ++i) {
+            pathHits += scorers[i]->fp.paths.getHits();
+            pathMisses += scorers[i]->fp.paths.getMisses();
+            lookups += scorers[i]->penalties.getLookups();
+            hits += scorers[i]->penalties.getHits();
+            for(j = 0; j < (int)calls.size(); ++j)
+                calls[j] += scorers[i]->penalties.getCalls(j);
+        }
+
+        if(allPaths)
+            Debugging::out() << "Shortest path rows: all " << scorer.fp.graph.verts.size() << " computed up front, "
+                             << pathHits << " lookups" << endl;
+        else
+            Debugging::out() << "Shortest path rows: " << pathMisses << " computed, " << pathHits
+                             << " cache hits (room for " << scorer.fp.paths.getMaxRows() << " per thread)" << endl;
+        Debugging::out() << "Penalty calls:";
+        for(i = 0; i < (int)calls.size(); ++i)
+            Debugging::out() << " " << scorer.functions[i]->getName() << " " << calls[i];
+        Debugging::out() << " (" << hits << " of " << lookups << " local lookups cached)" << endl;
+        Debugging::out() << "Path splits: " << splitCache->getMisses() << " computed, "
+                         << splitCache->getHits() << " reused" << endl;
+    }
+
+    vector<SearchNode> nodes;
+    vector<int> takenVerts; //vertices newly taken by each node (see SearchNode)
+
+private:
+    const vector<vector<int> > &possibilities;
+    bool parallel;
+    PathSplitCache ownSplitCache, *splitCache;
+    AllShortestPather *allPaths; //NULL unless all of them fit in the path cache
+    vector<Scorer *> scorers;
+    vector<pair<int, int> > children; //(node, candidate)
+    vector<ChildScore> scores;
+};
+
+//orders beam search candidates by heuristic, then by creation
+class BeamOrder
+{
+public:
+    BeamOrder(const vector<SearchNode> *inNodes) : nodes(inNodes) {}
+    bool operator()(int n1, int n2) const
+    {
+        if((*nodes)[n1].heuristic != (*nodes)[n2].heuristic)
+            return (*nodes)[n1].heuristic < (*nodes)[n2].heuristic;
+        return n1 < n2;
+    }
+
+private:
+    const vector<SearchNode> *nodes;
+};
+
+//orders complete matches by penalty
+class CompleteOrder
+{
+public:
+    CompleteOrder(const vector<SearchNode> *inNodes) : nodes(inNodes) {}
+    bool operator()(int n1, int n2) const { return (*nodes)[n1].penalty < (*nodes)[n2].penalty; }
+
+private:
+    const vector<SearchNode> *nodes;
+};
+
+//keeps the numMatches best complete matches, sorted (ties stay in the order they were found)
+static void addComplete(vector<int> &complete, int node, int numMatches, const CompleteOrder &order)
+{
+    complete.insert(upper_bound(complete.begin(), complete.end(), node, order), node);
+    if((int)complete.size() > numMatches)
+        complete.pop_back();
+}
+
+//the search itself, on a single level
+vector<int> searchMatch(const PtGraph &graph, const vector<Sphere> &spheres,
+                        const Skeleton &skeleton, const vector<vector<int> > &possibilities,
+                        const EmbedOptions &options, EmbedResult *result)
+{
+    int i;
+    Timer timer;
+
+    MatchSearch search(graph, spheres, skeleton, possibilities, options);
+    vector<SearchNode> &nodes = search.nodes;
+    int batchSize = max(1, options.batchSize);
 
     int toMatch = skeleton.cGraph().verts.size();
+    int numMatches = max(1, options.numMatches);
     
     Debugging::out() << "Matching!" << endl;
     
-    priority_queue<PartialMatch> todo;
-    
-    PartialMatch output(graph.verts.size());
-    todo.push(output);
-    
+    priority_queue<int, vector<int>, SearchNodeOrder> todo((SearchNodeOrder(&nodes)));
+    todo.push(0);
+
+    //Expand the batchSize best nodes at a time (k-best-first search).  A complete match is only
+    //accepted once no node left in the queue has a lower heuristic, so larger batches explore
+    //more nodes but find the same kind of optimum as expanding one node at a time.
+    //If half the time or the whole queue allowance is used up, we give up on optimality.
+    //For the numMatches best matches, the search goes on until no queued node can beat the worst
+    //of them.
+    int expanded = 0;
+    bool outOfBudget = false;
+    vector<int> batch, added;
+    vector<int> complete; //the best complete matches so far, in order of penalty
+    CompleteOrder completeOrder(&nodes);
+
     int maxSz = 0;
     
     while(!todo.empty()) {
-        PartialMatch cur = todo.top();
-        todo.pop();
-        
-        int idx = cur.match.size();
-        
-        int curSz = (int)log((double)todo.size());
-        if(curSz > maxSz) {
-            maxSz = curSz;
-            if(maxSz > 3)
-                Debugging::out() << "Reached " << todo.size() << endl;
-        }
-        
-        if(idx == toMatch) {
-            output = cur;
-            Debugging::out() << "Found: residual = " << cur.penalty << endl;
+        if((options.maxSeconds > 0. && timer.elapsed() >= 0.5 * options.maxSeconds) ||
+           (options.maxQueue > 0 && (int)todo.size() >= options.maxQueue)) {
+            outOfBudget = true;
             break;
         }
-        
-        for(i = 0; i < (int)possibilities[idx].size(); ++i) {
-            int candidate = possibilities[idx][i];
-            int k;
-            double extraPenalty = computePenalty(penaltyFunctions, cur, candidate);
-
-            if(extraPenalty < 0)
-                Debugging::out() << "ERR = " << extraPenalty << endl;
-            if(cur.penalty + extraPenalty < 1.) {
-                PartialMatch next = cur;
-                next.match.push_back(candidate);
-                next.penalty += extraPenalty;
-                next.heuristic = next.penalty;
-                
-                //compute taken vertices and edges
-                if(idx > 0) {
-                    vector<int> path = fp.paths.path(candidate, next.match[skeleton.cPrev()[idx]]);
-                    for(j = 0; j < (int)path.size(); ++j)
-                        next.vTaken[path[j]] = true;
-                }
 
-                //compute heuristic
-                for(j = idx + 1; j < toMatch; ++j) {
-                    if(skeleton.cPrev()[j] > idx)
-                        continue;
-                    double minP = 1e37;
-                    for(k = 0; k < (int)possibilities[j].size(); ++k) {
-                        minP = min(minP, computePenalty(penaltyFunctions, next, possibilities[j][k], j));
-                    }
-                    next.heuristic += minP;
-                    if(next.heuristic > 1.)
-                        break;
+        batch.clear();
+        while(!todo.empty() && (int)batch.size() < batchSize &&
+              ((int)complete.size() < numMatches || nodes[todo.top()].heuristic < nodes[complete.back()].penalty)) {
+            int curNode = todo.top();
+            todo.pop();
+
+            int curSz = (int)log((double)todo.size());
+            if(curSz > maxSz) {
+                maxSz = curSz;
+                if(maxSz > 3)
+                    Debugging::out() << "Reached " << todo.size() << endl;
+            }
+
+            if(nodes[curNode].size == toMatch) {
+                addComplete(complete, curNode, numMatches, completeOrder);
+                continue;
+            }
+            batch.push_back(curNode);
+        }
+        if(batch.empty())
+            break;
+        expanded += batch.size();
+
+        search.expand(batch, added);
+        for(i = 0; i < (int)added.size(); ++i)
+            todo.push(added[i]);
+    }
+
+    //Out of budget: every match is at least the smallest heuristic in the queue.  Finish with a
+    //beam search from the best queued nodes, keeping the beamWidth best children at every step.
+    double lowerBound = 1.;
+    if(outOfBudget) {
+        lowerBound = nodes[todo.top()].heuristic;
+        Debugging::out() << "Out of budget with " << todo.size() << " queued; beam search" << endl;
+
+        //Past the deadline, the search stops as soon as it has a complete match, and until then
+        //it only follows the best child.  If every child of the beam is pruned before a match is
+        //complete, the beam is refilled from the queue.
+        vector<int> beam;
+        int beamWidth = max(1, options.beamWidth);
+        bool refill = true;
+        while(true) {
+            if(refill) {
+                while(!todo.empty() && (int)beam.size() < beamWidth) {
+                    beam.push_back(todo.top());
+                    todo.pop();
                 }
+            }
+            if(beam.empty())
+                break;
 
-                if(next.heuristic > 1.)
-                    continue;
+            batch.clear();
+            for(i = 0; i < (int)beam.size(); ++i) {
+                if(nodes[beam[i]].size < toMatch)
+                    batch.push_back(beam[i]);
+                else
+                    addComplete(complete, beam[i], numMatches, completeOrder);
+            }
 
-                todo.push(next);
+            bool late = options.maxSeconds > 0. && timer.elapsed() >= options.maxSeconds;
+            if(late) {
+                if(!complete.empty())
+                    break;
+                beamWidth = 1;
+                if(batch.size() > 1)
+                    batch.resize(1); //the beam is sorted
             }
+            expanded += batch.size();
+
+            search.expand(batch, added);
+            sort(added.begin(), added.end(), BeamOrder(&nodes));
+            if((int)added.size() > beamWidth)
+                added.resize(beamWidth);
+            beam.swap(added);
+            refill = beam.empty() && complete.empty();
         }
     }
-    
-    if(output.match.size() == 0)
+
+    int best = complete.empty() ? -1 : complete[0];
+    vector<int> output;
+    if(best >= 0) {
+        output = search.getMatch(best);
+        Debugging::out() << "Found: residual = " << nodes[best].penalty;
+        if(outOfBudget)
+            Debugging::out() << " (lower bound " << lowerBound << ")";
+        Debugging::out() << endl;
+    }
+    else
     {
         Debugging::out() << "No Match" << endl;
     }
 
-    for(i = 0; i < (int)penaltyFunctions.size(); ++i)
-        delete penaltyFunctions[i];
+    if(result) {
+        result->penalty = (best >= 0) ? nodes[best].penalty : -1.;
+        result->optimal = (best >= 0) && (!outOfBudget || nodes[best].penalty <= lowerBound);
+        result->matches.clear();
+        result->penalties.clear();
+        for(i = 0; i < (int)complete.size(); ++i) {
+            result->matches.push_back(search.getMatch(complete[i]));
+            result->penalties.push_back(nodes[complete[i]].penalty);
+        }
+    }
+
+    search.report();
+    Debugging::out() << "Expanded " << expanded << " of " << nodes.size() << " search nodes in "
+                     << timer.elapsed() << "s (" << search.getNumThreads() << " threads, batches of " << batchSize << ")" << endl;
 
-    return output.match;
+    return output;
+}
+
+//Clusters the sphere graph by matching each sphere with its closest unmatched neighbor, larger
+//spheres choosing first.  A cluster is represented by its largest sphere, so the coarse spheres are
+//still sorted by radius.  Two clusters are adjacent if any of their spheres are.
+void coarsenGraph(const PtGraph &graph, const vector<Sphere> &spheres, PtGraph &coarseGraph,
+                  vector<Sphere> &coarseSpheres, vector<int> &cluster)
+{
+    int i, j;
+    int sz = graph.verts.size();
+
+    cluster.assign(sz, -1);
+    coarseGraph = PtGraph();
+    coarseSpheres.clear();
+    for(i = 0; i < sz; ++i) {
+        if(cluster[i] >= 0)
+            continue;
+        int partner = -1;
+        double partnerDist = 0.;
+        for(j = 0; j < (int)graph.edges[i].size(); ++j) {
+            int oth = graph.edges[i][j];
+            if(cluster[oth] >= 0)
+                continue;
+            double dist = (graph.verts[oth] - graph.verts[i]).lengthsq();
+            if(partner < 0 || dist < partnerDist || (dist == partnerDist && oth < partner)) {
+                partner = oth;
+                partnerDist = dist;
+            }
+        }
+        cluster[i] = coarseSpheres.size();
+        if(partner >= 0)
+            cluster[partner] = cluster[i];
+        coarseGraph.verts.push_back(graph.verts[i]);
+        coarseSpheres.push_back(spheres[i]);
+    }
+
+    coarseGraph.edges.resize(coarseGraph.verts.size());
+    for(i = 0; i < sz; ++i) {
+        for(j = 0; j < (int)graph.edges[i].size(); ++j) {
+            int c1 = cluster[i], c2 = cluster[graph.edges[i][j]];
+            if(c1 != c2)
+                coarseGraph.edges[c1].push_back(c2);
+        }
+    }
+    for(i = 0; i < (int)coarseGraph.edges.size(); ++i) {
+        vector<int> &edg = coarseGraph.edges[i];
+        sort(edg.begin(), edg.end());
+        edg.erase(unique(edg.begin(), edg.end()), edg.end());
+    }
+}
+
+//Coarse-to-fine: the skeleton is first embedded into a graph of clusters of spheres (recursively,
+//until there are at most coarseSpheres of them) and then each joint may only go to the spheres in
+//its coarse sphere's cluster or in the clusters adjacent to it.
+static const int nearQueue = 4096; //queue limit for searches near a coarse match, unless one is given
+
+//options with maxSeconds reduced to what is left of it (but still a limit), times the given fraction
+static EmbedOptions remainingTime(const EmbedOptions &options, const Timer &timer, double fraction = 1.)
+{
+    EmbedOptions out(options);
+    if(options.maxSeconds > 0.)
+        out.maxSeconds = max(1e-6, fraction * (options.maxSeconds - timer.elapsed()));
+    return out;
+}
+
+static bool outOfTime(const EmbedOptions &options, const Timer &timer)
+{
+    return options.maxSeconds > 0. && timer.elapsed() >= options.maxSeconds;
+}
+
+vector<int> discreteEmbed(const PtGraph &graph, const vector<Sphere> &spheres,
+                          const Skeleton &skeleton, const vector<vector<int> > &possibilities,
+                          const EmbedOptions &options, EmbedResult *result)
+{
+    int i, j;
+    Timer timer; //maxSeconds is shared by all the levels
+
+    if(options.coarseSpheres <= 0 || (int)graph.verts.size() <= options.coarseSpheres)
+        return searchMatch(graph, spheres, skeleton, possibilities, options, result);
+
+    PtGraph coarseGraph;
+    vector<Sphere> coarseSpheres;
+    vector<int> cluster;
+    coarsenGraph(graph, spheres, coarseGraph, coarseSpheres, cluster);
+    int coarseSz = coarseGraph.verts.size();
+    if(coarseSz == (int)graph.verts.size()) //nothing to merge
+        return searchMatch(graph, spheres, skeleton, possibilities, options, result);
+
+    Debugging::out() << "Coarse level: " << coarseSz << " clusters of " << graph.verts.size() << " spheres" << endl;
+
+    //a joint may go to a cluster if it may go to one of its spheres and the cluster passes the
+    //usual tests (unless none of them do)
+    vector<vector<int> > coarsePossibilities = computePossibilities(coarseGraph, coarseSpheres, skeleton);
+    vector<char> allowed(coarseSz);
+    for(i = 0; i < (int)possibilities.size(); ++i) {
+        allowed.assign(coarseSz, 0);
+        for(j = 0; j < (int)possibilities[i].size(); ++j)
+            allowed[cluster[possibilities[i][j]]] = 1;
+
+        vector<int> both;
+        for(j = 0; j < (int)coarsePossibilities[i].size(); ++j)
+            if(allowed[coarsePossibilities[i][j]])
+                both.push_back(coarsePossibilities[i][j]);
+        if(both.empty()) {
+            for(j = 0; j < coarseSz; ++j)
+                if(allowed[j])
+                    both.push_back(j);
+        }
+        coarsePossibilities[i].swap(both);
+    }
+
+    EmbedOptions coarseOptions = remainingTime(options, timer, 0.5);
+    coarseOptions.splitCache = NULL; //the cache is for this graph
+    coarseOptions.numMatches = 1;
+    vector<int> coarseMatch = discreteEmbed(coarseGraph, coarseSpheres, skeleton, coarsePossibilities,
+                                            coarseOptions);
+    if(coarseMatch.empty()) {
+        if(outOfTime(options, timer)) {
+            Debugging::out() << "No coarse match and out of time" << endl;
+            if(result)
+                *result = EmbedResult();
+            return vector<int>();
+        }
+        Debugging::out() << "No coarse match; searching all " << graph.verts.size() << " spheres" << endl;
+        return searchMatch(graph, spheres, skeleton, possibilities, remainingTime(options, timer), result);
+    }
+
+    vector<vector<int> > nearPossibilities(possibilities.size());
+    for(i = 0; i < (int)possibilities.size(); ++i) {
+        int c = coarseMatch[i];
+        allowed.assign(coarseSz, 0);
+        allowed[c] = 1;
+        for(j = 0; j < (int)coarseGraph.edges[c].size(); ++j)
+            allowed[coarseGraph.edges[c][j]] = 1;
+
+        for(j = 0; j < (int)possibilities[i].size(); ++j)
+            if(allowed[cluster[possibilities[i][j]]])
+                nearPossibilities[i].push_back(possibilities[i][j]);
+        if(nearPossibilities[i].empty())
+            nearPossibilities[i] = possibilities[i];
+    }
+
+    //the coarse match is already close, so don't spend long proving which of the nearby spheres is best
+    EmbedOptions nearOptions = remainingTime(options, timer);
+    if(nearOptions.maxQueue <= 0)
+        nearOptions.maxQueue = nearQueue;
+    vector<int> out = searchMatch(graph, spheres, skeleton, nearPossibilities, nearOptions, result);
+    if(out.empty()) {
+        if(outOfTime(options, timer)) {
+            Debugging::out() << "No match near the coarse one and out of time" << endl;
+            return out;
+        }
+        Debugging::out() << "No match near the coarse one; searching all " << graph.verts.size() << " spheres" << endl;
+        return searchMatch(graph, spheres, skeleton, possibilities, remainingTime(options, timer), result);
+    }
+    if(result)
+        result->optimal = false; //only the spheres near the coarse match were searched
+    return out;
 }
 
 vector<Vector3> splitPath(FP *fp, int joint, int curIdx, int prevIdx)
 {
     int i;
+    vector<Vector3> cached;
+    if(fp->splitCache && fp->splitCache->find(joint, curIdx, prevIdx, cached))
+        return cached;
+
     vector<int> newPath = fp->paths.path(prevIdx, curIdx);
 
     vector<int> uncompIdx; //stores the indices of the path in the unsimplified skeleton
@@ -264,14 +1081,17 @@ vector<Vector3> splitPath(FP *fp, int joint, int curIdx, int prevIdx)
                 break;
         }
     }
+
+    if(fp->splitCache)
+        fp->splitCache->insert(joint, curIdx, prevIdx, pathPts);
     
     return pathPts;
 }
 
 vector<Vector3> splitPaths(const vector<int> &discreteEmbedding, const PtGraph &graph,
-                                         const Skeleton &skeleton)
+                                         const Skeleton &skeleton, PathSplitCache *splitCache)
 {
-    FP fp(graph, skeleton, vector<Sphere>());
+    FP fp(graph, skeleton, vector<Sphere>(), 0, splitCache);
 
     vector<Vector3> out;
 
@@ -306,6 +1126,8 @@ class DistPF : public PenaltyFunction
 {
 public:
     DistPF(FP *inFp) : PenaltyFunction(inFp) { }
+    const char *getName() const { return "DistPF"; }
+    bool isLocal() const { return true; }
     double get(const PartialMatch &cur, int next, int idx) const
     {
         int prev = fp->given.cPrev()[idx];
@@ -322,6 +1144,23 @@ public:
         double out = CUBE(smoothInterp(optDist / (dist + distPlay), 0.5, 0., 2., 3.));
         return out;
     }
+
+    void getMany(const PartialMatch &cur, const int *next, int num, int idx, double *out) const
+    {
+        int prevSphere = cur.match[fp->given.cPrev()[idx]];
+        const float *dists = fp->paths.distancesTo(prevSphere);
+        const double *radius = &(fp->radius[0]);
+        double prevRadius = radius[prevSphere];
+        double optDist = fp->given.cLength()[idx];
+
+        for(int i = 0; i < num; ++i) {
+            double dist = dists[next[i]];
+            double distPlay = distPlayFactor * (radius[next[i]] + prevRadius);
+            double ratio = smoothInterp(optDist / (dist + distPlay), 0.5, 0., 2., 3.);
+            bool noMatch = dist < 0 || dist + distPlay < 0.5 * optDist;
+            out[i] = noMatch ? NOMATCH : CUBE(ratio);
+        }
+    }
 };
 
 vector<Vector3> computeDirs(FP * fp, const PartialMatch &cur, int next, int idx = -1)
@@ -350,6 +1189,8 @@ class DotPF : public PenaltyFunction
 {
 public:
     DotPF(FP *inFp) : PenaltyFunction(inFp) { }
+    const char *getName() const { return "DotPF"; }
+    bool isLocal() const { return true; }
     double get(const PartialMatch &cur, int next, int idx) const
     {
         double out = 0.;
@@ -406,6 +1247,7 @@ class SymPF : public PenaltyFunction
 {
 public:
     SymPF(FP *inFp) : PenaltyFunction(inFp) { }
+    const char *getName() const { return "SymPF"; }
     double get(const PartialMatch &cur, int next, int idx) const
     {
         int prev = fp->given.cPrev()[idx];
@@ -433,6 +1275,7 @@ class GlobalDotPF : public PenaltyFunction
 {
 public:
     GlobalDotPF(FP *inFp) : PenaltyFunction(inFp) { }
+    const char *getName() const { return "GlobalDotPF"; }
     double get(const PartialMatch &cur, int next, int idx) const
     {
         int prev = fp->given.cPrev()[idx];
@@ -461,6 +1304,36 @@ public:
         }
         return out;
     }
+
+    void getMany(const PartialMatch &cur, const int *next, int num, int idx, double *out) const
+    {
+        int i, j;
+        int prev = fp->given.cPrev()[idx];
+        const double *x = &(fp->vertX[0]), *y = &(fp->vertY[0]), *z = &(fp->vertZ[0]);
+
+        for(j = 0; j < num; ++j)
+            out[j] = 0.;
+        for(i = 0; i < (int)cur.match.size(); ++i) {
+            if(i != prev && fp->given.cPrev()[i] != prev)
+                continue;
+            int m = cur.match[i];
+            Vector3 givenBigDir = (fp->given.cGraph().verts[idx] - fp->given.cGraph().verts[i]).normalize();
+            double minDot = (i == prev) ? 0. : -0.5;
+            double scale = (i == prev) ? 4. : 2.;
+            double offset = (i == prev) ? 0.1 : 0.5;
+
+            //once a candidate gets NOMATCH it keeps it
+            for(j = 0; j < num; ++j) {
+                double dx = x[next[j]] - x[m], dy = y[next[j]] - y[m], dz = z[next[j]] - z[m];
+                double len = sqrt(dx * dx + dy * dy + dz * dz);
+                double dot = dx / len * givenBigDir[0] + dy / len * givenBigDir[1] + dz / len * givenBigDir[2];
+                bool skip = dx * dx + dy * dy + dz * dz < 1e-16;
+                double term = 0.5 * max(0., SQR((1. - dot) * scale) - offset);
+                bool noMatch = out[j] == NOMATCH || (!skip && dot < minDot);
+                out[j] = noMatch ? NOMATCH : (skip ? out[j] : out[j] + term);
+            }
+        }
+    }
 };
 
 //penalizes doubled paths
@@ -468,6 +1341,7 @@ class DoublePF : public PenaltyFunction
 {
 public:
     DoublePF(FP *inFp) : PenaltyFunction(inFp) { }
+    const char *getName() const { return "DoublePF"; }
     double get(const PartialMatch &cur, int next, int idx) const
     {
         int prev = fp->given.cPrev()[idx];
@@ -491,12 +1365,22 @@ class FootPF : public PenaltyFunction
 {
 public:
     FootPF(FP *inFp) : PenaltyFunction(inFp) { }
+    const char *getName() const { return "FootPF"; }
+    bool isLocal() const { return true; }
     double get(const PartialMatch &, int next, int idx) const
     {
         if(fp->given.cFeet()[idx])
             return (fp->graph.verts[next][1] - fp->footBase);
         return 0;
     }
+
+    void getMany(const PartialMatch &, const int *next, int num, int idx, double *out) const
+    {
+        double feet = fp->given.cFeet()[idx] ? 1. : 0.;
+        const double *y = &(fp->vertY[0]);
+        for(int i = 0; i < num; ++i)
+            out[i] = feet * (y[next[i]] - fp->footBase);
+    }
 };
 
 //penalizes duplicate nodes
@@ -504,6 +1388,8 @@ class DupPF : public PenaltyFunction
 {
 public:
     DupPF(FP *inFp) : PenaltyFunction(inFp) { }
+    const char *getName() const { return "DupPF"; }
+    bool isLocal() const { return true; }
     double get(const PartialMatch &cur, int next, int idx) const
     {
         if(next == cur.match[fp->given.cPrev()[idx]])
@@ -517,6 +1403,8 @@ class ExtremPF : public PenaltyFunction
 {
 public:
     ExtremPF(FP *inFp) : PenaltyFunction(inFp) { }
+    const char *getName() const { return "ExtremPF"; }
+    bool isLocal() const { return true; }
     double get(const PartialMatch &cur, int next, int idx) const
     {
         int prev = fp->given.cPrev()[idx];
@@ -544,6 +1432,7 @@ class DisjointPF : public PenaltyFunction
 {
 public:
     DisjointPF(FP *inFp) : PenaltyFunction(inFp) { }
+    const char *getName() const { return "DisjointPF"; }
     double get(const PartialMatch &cur, int next, int idx) const
     {
         int prev = fp->given.cPrev()[idx];
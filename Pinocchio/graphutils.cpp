@@ -72,3 +72,131 @@ ShortestPather::ShortestPather(const PtGraph &g, int root)
         }
     }
 }
+
+FlatGraph::FlatGraph(const PtGraph &g) : edgeStart(g.verts.size() + 1, 0)
+{
+    for(int i = 0; i < (int)g.verts.size(); ++i) {
+        for(int j = 0; j < (int)g.edges[i].size(); ++j) {
+            edgeTo.push_back(g.edges[i][j]);
+            edgeLength.push_back((g.verts[i] - g.verts[g.edges[i][j]]).length());
+        }
+        edgeStart[i + 1] = edgeTo.size();
+    }
+}
+
+template<class Index> void FlatGraph::search(int root, float *dist, Index *prev, Scratch &scratch) const
+{
+    int i, sz = size();
+    vector<Inf> &todo = scratch.todo;
+    vector<bool> &done = scratch.done;
+    done.assign(sz, false);
+    for(i = 0; i < sz; ++i) {
+        dist[i] = -1.f;
+        prev[i] = (Index)i;
+    }
+
+    todo.push_back(Inf(0., root, root));
+    while(!todo.empty()) {
+        pop_heap(todo.begin(), todo.end());
+        Inf cur = todo.back();
+        todo.pop_back();
+        if(done[cur.node])
+            continue;
+        done[cur.node] = true;
+        dist[cur.node] = (float)cur.dist;
+        prev[cur.node] = (Index)cur.prev;
+
+        for(i = edgeStart[cur.node]; i < edgeStart[cur.node + 1]; ++i) {
+            if(!done[edgeTo[i]]) {
+                todo.push_back(Inf(cur.dist + edgeLength[i], edgeTo[i], cur.node));
+                push_heap(todo.begin(), todo.end());
+            }
+        }
+    }
+}
+
+template void FlatGraph::search<unsigned short>(int, float *, unsigned short *, Scratch &) const;
+template void FlatGraph::search<int>(int, float *, int *, Scratch &) const;
+
+AllShortestPather::AllShortestPather(const PtGraph &g) : sz(g.verts.size()), peakMemory(0)
+{
+    int i;
+    size_t cells = (size_t)sz * sz;
+    distances.resize(cells);
+    if(sz <= 65536)
+        shortPrev.resize(cells);
+    else
+        longPrev.resize(cells);
+
+    FlatGraph flat(g);
+    peakMemory = cells * (sizeof(float) + (shortPrev.empty() ? sizeof(int) : sizeof(unsigned short))) +
+        flat.getMemory();
+
+#pragma omp parallel
+    {
+        FlatGraph::Scratch scratch;
+
+#pragma omp for schedule(dynamic, 16)
+        for(i = 0; i < sz; ++i) {
+            size_t start = (size_t)i * sz;
+            if(shortPrev.empty())
+                flat.search(i, &(distances[start]), &(longPrev[start]), scratch);
+            else
+                flat.search(i, &(distances[start]), &(shortPrev[start]), scratch);
+        }
+
+        size_t scratchMemory = scratch.todo.capacity() * sizeof(FlatGraph::Inf) + sz / 8;
+#pragma omp critical
+        peakMemory += scratchMemory;
+    }
+
+    Debugging::out() << "All shortest paths: " << sz << " vertices, peak memory " << peakMemory << " bytes" << endl;
+}
+
+LazyShortestPather::LazyShortestPather(const PtGraph &g, size_t maxBytes, const AllShortestPather *inAll)
+    : all(inAll), graph(inAll ? PtGraph() : g), sz(g.verts.size()), slot(inAll ? 0 : sz, -1),
+      lruPos(inAll ? 0 : sz), hits(0), misses(0)
+{
+    if(all) {
+        maxRows = sz;
+        return;
+    }
+
+    size_t rowBytes = max(1, sz) * (sizeof(float) + (sz <= 65536 ? sizeof(unsigned short) : sizeof(int)));
+    maxRows = sz;
+    if(maxBytes > 0)
+        maxRows = max(1, (int)min((size_t)sz, maxBytes / rowBytes));
+}
+
+int LazyShortestPather::computeRow(int root) const
+{
+    ++misses;
+
+    int r;
+    if((int)rootOf.size() < maxRows) { //room for another row
+        r = rootOf.size();
+        rootOf.push_back(root);
+        distances.resize(rootOf.size() * (size_t)sz);
+        if(sz <= 65536)
+            shortPrev.resize(distances.size());
+        else
+            longPrev.resize(distances.size());
+    }
+    else { //reuse the least recently used row
+        r = slot[lru.back()];
+        slot[lru.back()] = -1;
+        lru.pop_back();
+        rootOf[r] = root;
+    }
+
+    size_t start = (size_t)r * sz;
+    if(shortPrev.empty())
+        graph.search(root, &(distances[start]), &(longPrev[start]), scratch);
+    else
+        graph.search(root, &(distances[start]), &(shortPrev[start]), scratch);
+
+    slot[root] = r;
+    lru.push_front(root);
+    lruPos[root] = lru.begin();
+    return r;
+}
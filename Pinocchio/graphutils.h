@@ -20,6 +20,7 @@
 #define GRAPHUTILS_H
 
 #include <queue>
+#include <list>
 #include "vector.h"
 
 struct PtGraph
@@ -57,22 +58,152 @@ private:
     vector<double> dist;
 };
 
+//A graph's adjacency lists flattened into arrays, with the edge lengths, for running many
+//shortest path searches
+class FlatGraph
+{
+public:
+    FlatGraph(const PtGraph &g);
+
+    struct Inf
+    {
+        Inf(double inDist, int inNode, int inPrev) : dist(inDist), node(inNode), prev(inPrev) {}
+        bool operator<(const Inf &inf) const { return dist > inf.dist; }
+        double dist;
+        int node, prev;
+    };
+
+    struct Scratch //reused between searches
+    {
+        vector<Inf> todo;
+        vector<bool> done;
+    };
+
+    //Dijkstra from root (same as ShortestPather), writing into arrays of size() elements: dist is -1
+    //for unreachable vertices and a vertex is its own predecessor if it is the root or unreachable
+    template<class Index> void search(int root, float *dist, Index *prev, Scratch &scratch) const;
+
+    int size() const { return (int)edgeStart.size() - 1; }
+    size_t getMemory() const
+    { return edgeStart.size() * sizeof(int) + edgeTo.size() * (sizeof(int) + sizeof(double)); }
+
+private:
+    vector<int> edgeStart, edgeTo;
+    vector<double> edgeLength;
+};
+
+//All pairs shortest paths: runs Dijkstra from every vertex (in parallel) and keeps only a compact
+//distance matrix (floats) and predecessor matrix (16 bit indices when there are few enough vertices).
+//Paths are reconstructed from the predecessors on demand.
 class AllShortestPather
 {
 public:
-    AllShortestPather() {}
-    
-    AllShortestPather(const PtGraph &g)
+    AllShortestPather() : sz(0), peakMemory(0) {}
+    AllShortestPather(const PtGraph &g);
+
+    vector<int> path(int from, int to) const
     {
-        for(int i = 0; i < (int)g.verts.size(); ++i)
-            paths.push_back(ShortestPather(g, i));
+        vector<int> out(1, from);
+        for(int p = prev(to, from); p != from; p = prev(to, from))
+            out.push_back(from = p);
+        return out;
     }
-    
-    vector<int> path(int from, int to) const { return paths[to].pathFrom(from); }
-    double dist(int from, int to) const { return paths[to].distFrom(from); }
-    
+    double dist(int from, int to) const { return distances[(size_t)to * sz + from]; }
+    const float *distancesTo(int to) const { return &(distances[(size_t)to * sz]); }
+
+    size_t getPeakMemory() const { return peakMemory; } //bytes used while computing, including scratch
+    static size_t matrixBytes(int sz) //of the matrices for a graph with sz vertices
+    { return (size_t)sz * sz * (sizeof(float) + (sz <= 65536 ? sizeof(unsigned short) : sizeof(int))); }
+
 private:
-    vector<ShortestPather> paths;
+    //a vertex is its own predecessor in the tree rooted at root if it is the root or unreachable
+    int prev(int root, int vtx) const
+    {
+        size_t idx = (size_t)root * sz + vtx;
+        return shortPrev.empty() ? longPrev[idx] : shortPrev[idx];
+    }
+
+    int sz;
+    vector<float> distances;
+    vector<unsigned short> shortPrev;
+    vector<int> longPrev;
+    size_t peakMemory;
+};
+
+//Same interface as AllShortestPather, but a row (the shortest paths to one vertex) is only computed
+//the first time it is needed.  At most maxBytes worth of rows are kept (0 means no limit); when
+//there is no room, the least recently used row is dropped.  Not safe for concurrent queries.
+//If all is given, every query goes to it instead (it can be shared by several threads).
+class LazyShortestPather
+{
+public:
+    LazyShortestPather(const PtGraph &g, size_t maxBytes = 0, const AllShortestPather *inAll = NULL);
+
+    vector<int> path(int from, int to) const
+    {
+        if(all) {
+            ++hits;
+            return all->path(from, to);
+        }
+        int r = row(to);
+        vector<int> out(1, from);
+        for(int p = prev(r, from); p != from; p = prev(r, from))
+            out.push_back(from = p);
+        return out;
+    }
+    double dist(int from, int to) const
+    {
+        if(all) {
+            ++hits;
+            return all->dist(from, to);
+        }
+        return distances[(size_t)row(to) * sz + from];
+    }
+    //dist(from, to) for every from, valid until the next query
+    const float *distancesTo(int to) const
+    {
+        if(all) {
+            ++hits;
+            return all->distancesTo(to);
+        }
+        return &(distances[(size_t)row(to) * sz]);
+    }
+
+    int getHits() const { return hits; }
+    int getMisses() const { return misses; }
+    int getMaxRows() const { return maxRows; }
+
+private:
+    //slot holding the row for root, computing it if necessary
+    int row(int root) const
+    {
+        if(slot[root] >= 0) {
+            ++hits;
+            if(lru.front() != root)
+                lru.splice(lru.begin(), lru, lruPos[root]);
+            return slot[root];
+        }
+        return computeRow(root);
+    }
+    int computeRow(int root) const;
+
+    int prev(int r, int vtx) const
+    {
+        size_t idx = (size_t)r * sz + vtx;
+        return shortPrev.empty() ? longPrev[idx] : shortPrev[idx];
+    }
+
+    const AllShortestPather *all;
+    FlatGraph graph;
+    int sz, maxRows;
+    mutable FlatGraph::Scratch scratch;
+    mutable vector<float> distances;
+    mutable vector<unsigned short> shortPrev;
+    mutable vector<int> longPrev;
+    mutable vector<int> slot, rootOf; //root -> slot and slot -> root, -1 if none
+    mutable list<int> lru; //roots that have rows, most recently used first
+    mutable vector<list<int>::iterator> lruPos;
+    mutable int hits, misses;
 };
 
 
@@ -23,6 +23,39 @@
 #include <iostream>
 #include "hashutils.h"
 #include "debugging.h"
+#include "timer.h"
+
+//one right hand side at a time, for factorizations that can't do better
+bool LLTMatrix::solveMany(double *B, int nrhs) const
+{
+    int i, r;
+    int sz = size();
+    vector<double> b(sz);
+    for(r = 0; r < nrhs; ++r) {
+        for(i = 0; i < sz; ++i)
+            b[i] = B[i * nrhs + r];
+        if(!solve(b))
+            return false;
+        for(i = 0; i < sz; ++i)
+            B[i * nrhs + r] = b[i];
+    }
+    return true;
+}
+
+bool SymbolicFactor::matches(const vector<vector<pair<int, double> > > &m) const
+{
+    int i, j;
+    if((int)m.size() != size())
+        return false;
+    for(i = 0; i < (int)m.size(); ++i) {
+        if(entryStart[i + 1] - entryStart[i] != (int)m[i].size())
+            return false;
+        for(j = 0; j < (int)m[i].size(); ++j)
+            if(entryColumn[entryStart[i] + j] != m[i][j].first)
+                return false;
+    }
+    return true;
+}
 
 #ifdef TAUCS //TAUCS
 
@@ -37,6 +70,16 @@ vector<int> SPDMatrix::computePerm() const
     return vector<int>(); //do nothing
 }
 
+void SPDMatrix::analyze(SymbolicFactor &out) const
+{
+    out = SymbolicFactor(); //taucs does its own analysis
+}
+
+LLTMatrix *SPDMatrix::factor(const SymbolicFactor &) const
+{
+    return factor();
+}
+
 class TaucsLLTMatrix : public LLTMatrix
 {
 public:
@@ -125,10 +168,12 @@ class MyLLTMatrix : public LLTMatrix
 {
 public:
     bool solve(vector<double> &b) const; //solves it in place
+    bool solveMany(double *B, int nrhs) const;
     int size() const { return m.size(); }
 
 private:
     void initMt();
+    template<int Width> void solveBlock(double *bp, int width) const;
     vector<vector<pair<int, double> > > m; //off-diagonal values stored by rows
     vector<vector<pair<int, double> > > mt; //off-diagonal values transposed stored by rows
     vector<double> diag; //values on diagonal
@@ -139,6 +184,37 @@ private:
 
 
 vector<int> SPDMatrix::computePerm() const
+{
+    int i;
+    Timer timer;
+    vector<int> out;
+    const char *name = "minimum degree";
+
+    if(ordering == NESTED_DISSECTION && positions.size() != m.size())
+        Debugging::out() << "No positions for nested dissection" << endl;
+
+    if(ordering == NESTED_DISSECTION && positions.size() == m.size()) {
+        out = nestedDissectionOrder();
+        name = "nested dissection";
+    }
+    else if(ordering == APPROXIMATE_MINIMUM_DEGREE || ordering == NESTED_DISSECTION) {
+        out = approximateMinimumDegreeOrder();
+        name = "approximate minimum degree";
+    }
+    else
+        out = minimumDegreeOrder();
+
+    Debugging::out() << "Ordering (" << name << ") took " << timer.elapsed() << "s" << endl;
+
+    vector<int> oout = out;
+    for(i = 0; i < (int)out.size(); ++i) //invert the permutation
+        out[oout[i]] = i;
+        
+    return out;
+}
+
+//greedy minimum degree, with explicit adjacency updates--returns the elimination order
+vector<int> SPDMatrix::minimumDegreeOrder() const
 {
     int i, j;
 
@@ -195,14 +271,376 @@ vector<int> SPDMatrix::computePerm() const
             neighborSize.insert(make_pair(neighbors[nb[i]].size(), nb[i]));
     }
 
-    vector<int> oout = out;
-    for(i = 0; i < sz; ++i) //invert the permutation
-        out[oout[i]] = i;
-        
+    return out;
+}
+
+/**
+* Approximate minimum degree (Amestoy, Davis & Duff) on the quotient graph: an eliminated vertex
+* becomes an element standing for the clique of its neighbors, instead of that clique being added.
+* Variables keep lists of adjacent variables and elements, elements keep lists of variables.  The
+* degree of a variable is approximated from the sizes of its elements outside the new element.
+* Variables with the same adjacency are merged into supervariables and elements contained in the
+* new element are absorbed.  Returns the elimination order.
+*/
+class AMDOrdering
+{
+public:
+    AMDOrdering(const vector<vector<pair<int, double> > > &m)
+        : n(m.size()), vars(n), elems(n), weight(n, 1), degree(n), status(n, VARIABLE), merged(n),
+          mark(n, 0), tag(0), external(n, -1), externalTag(n, 0), head(n + 1, -1), next(n, -1), prev(n, -1),
+          minDegree(0)
+    {
+        int i, j;
+        for(i = 0; i < n; ++i) {
+            for(j = 0; j < (int)m[i].size(); ++j) {
+                int k = m[i][j].first;
+                if(k == i)
+                    continue;
+                vars[i].push_back(k);
+                vars[k].push_back(i);
+            }
+        }
+        for(i = 0; i < n; ++i) {
+            degree[i] = vars[i].size();
+            insert(i);
+        }
+    }
+
+    vector<int> order()
+    {
+        int i, j, k;
+        vector<int> out;
+        out.reserve(n);
+        int eliminated = 0;
+
+        while(eliminated < n) {
+            while(head[minDegree] == -1)
+                ++minDegree;
+            int p = head[minDegree];
+            remove(p);
+
+            //the new element: p's variables and the variables of its elements, which it absorbs
+            vector<int> lp;
+            newTag();
+            mark[p] = tag;
+            addVariables(vars[p], lp);
+            for(i = 0; i < (int)elems[p].size(); ++i) {
+                int e = elems[p][i];
+                if(status[e] != ELEMENT)
+                    continue;
+                addVariables(vars[e], lp);
+                status[e] = ABSORBED;
+                vector<int>().swap(vars[e]);
+            }
+            vector<int>().swap(elems[p]);
+            status[p] = ELEMENT;
+
+            out.push_back(p);
+            out.insert(out.end(), merged[p].begin(), merged[p].end());
+            eliminated += weight[p];
+
+            //p replaces the absorbed elements and the variables of lp next to each other
+            int lpWeight = 0;
+            for(i = 0; i < (int)lp.size(); ++i) {
+                int v = lp[i];
+                remove(v);
+                lpWeight += weight[v];
+
+                vector<int> &ev = elems[v];
+                for(j = k = 0; j < (int)ev.size(); ++j)
+                    if(status[ev[j]] == ELEMENT)
+                        ev[k++] = ev[j];
+                ev.resize(k);
+                ev.push_back(p);
+
+                vector<int> &vv = vars[v];
+                for(j = k = 0; j < (int)vv.size(); ++j)
+                    if(status[vv[j]] == VARIABLE && mark[vv[j]] != tag)
+                        vv[k++] = vv[j];
+                vv.resize(k);
+            }
+
+            //external[e] = weight of element e outside lp, for the elements next to lp
+            for(i = 0; i < (int)lp.size(); ++i) {
+                int v = lp[i];
+                for(j = 0; j < (int)elems[v].size(); ++j) {
+                    int e = elems[v][j];
+                    if(e == p)
+                        continue;
+                    if(externalTag[e] != tag) {
+                        externalTag[e] = tag;
+                        external[e] = elementWeight(e);
+                    }
+                    external[e] -= weight[v];
+                }
+            }
+
+            //approximate degrees, absorbing elements that are inside lp
+            for(i = 0; i < (int)lp.size(); ++i) {
+                int v = lp[i];
+                int d = lpWeight - weight[v];
+                vector<int> &ev = elems[v];
+                for(j = k = 0; j < (int)ev.size(); ++j) {
+                    int e = ev[j];
+                    if(e != p && external[e] == 0)
+                        status[e] = ABSORBED;
+                    if(status[e] != ELEMENT)
+                        continue;
+                    if(e != p)
+                        d += external[e];
+                    ev[k++] = e;
+                }
+                ev.resize(k);
+                for(j = 0; j < (int)vars[v].size(); ++j)
+                    d += weight[vars[v][j]];
+                degree[v] = min(min(d, degree[v] + lpWeight - weight[v]), n - eliminated - weight[v]);
+            }
+
+            findSupervariables(lp);
+
+            for(i = k = 0; i < (int)lp.size(); ++i) {
+                int v = lp[i];
+                if(status[v] != VARIABLE)
+                    continue;
+                lp[k++] = v;
+                insert(v);
+            }
+            lp.resize(k);
+            vars[p].swap(lp);
+        }
+
+        return out;
+    }
+
+private:
+    enum Status { VARIABLE, ELEMENT, ABSORBED, MERGED };
+
+    void newTag() { ++tag; }
+
+    void addVariables(const vector<int> &from, vector<int> &to)
+    {
+        for(int i = 0; i < (int)from.size(); ++i) {
+            int v = from[i];
+            if(status[v] == VARIABLE && mark[v] != tag) {
+                mark[v] = tag;
+                to.push_back(v);
+            }
+        }
+    }
+
+    int elementWeight(int e) //also drops variables that are no longer there
+    {
+        int i, k, out = 0;
+        vector<int> &ve = vars[e];
+        for(i = k = 0; i < (int)ve.size(); ++i) {
+            if(status[ve[i]] != VARIABLE)
+                continue;
+            out += weight[ve[i]];
+            ve[k++] = ve[i];
+        }
+        ve.resize(k);
+        return out;
+    }
+
+    //merges variables of lp with the same elements and variables
+    void findSupervariables(const vector<int> &lp)
+    {
+        int i, j, k;
+        vector<pair<unsigned int, int> > hashes;
+        for(i = 0; i < (int)lp.size(); ++i) {
+            int v = lp[i];
+            unsigned int h = elems[v].size() * 31 + vars[v].size();
+            for(j = 0; j < (int)elems[v].size(); ++j)
+                h += elems[v][j] * 2654435761u;
+            for(j = 0; j < (int)vars[v].size(); ++j)
+                h += vars[v][j] * 2246822519u;
+            hashes.push_back(make_pair(h, v));
+        }
+        sort(hashes.begin(), hashes.end());
+
+        for(i = 0; i < (int)hashes.size(); i = j) {
+            for(j = i + 1; j < (int)hashes.size() && hashes[j].first == hashes[i].first; ++j)
+                ;
+            for(int a = i; a < j; ++a) {
+                int v = hashes[a].second;
+                if(status[v] != VARIABLE)
+                    continue;
+                newTag();
+                for(k = 0; k < (int)elems[v].size(); ++k)
+                    mark[elems[v][k]] = tag;
+                for(k = 0; k < (int)vars[v].size(); ++k)
+                    mark[vars[v][k]] = tag;
+                for(int b = a + 1; b < j; ++b) {
+                    int u = hashes[b].second;
+                    if(status[u] != VARIABLE || elems[u].size() != elems[v].size() || vars[u].size() != vars[v].size())
+                        continue;
+                    bool same = true;
+                    for(k = 0; same && k < (int)elems[u].size(); ++k)
+                        same = (mark[elems[u][k]] == tag);
+                    for(k = 0; same && k < (int)vars[u].size(); ++k)
+                        same = (mark[vars[u][k]] == tag);
+                    if(!same)
+                        continue;
+                    weight[v] += weight[u];
+                    degree[v] -= weight[u];
+                    weight[u] = 0;
+                    status[u] = MERGED;
+                    merged[v].push_back(u);
+                    merged[v].insert(merged[v].end(), merged[u].begin(), merged[u].end());
+                    vector<int>().swap(merged[u]);
+                    vector<int>().swap(elems[u]);
+                    vector<int>().swap(vars[u]);
+                }
+            }
+        }
+    }
+
+    //degree lists
+    void insert(int v)
+    {
+        int d = max(0, degree[v]);
+        next[v] = head[d];
+        prev[v] = -1;
+        if(head[d] != -1)
+            prev[head[d]] = v;
+        head[d] = v;
+        minDegree = min(minDegree, d);
+    }
+
+    void remove(int v)
+    {
+        if(prev[v] != -1)
+            next[prev[v]] = next[v];
+        else if(head[max(0, degree[v])] == v)
+            head[max(0, degree[v])] = next[v];
+        else
+            return; //not in a list
+        if(next[v] != -1)
+            prev[next[v]] = prev[v];
+        next[v] = prev[v] = -1;
+    }
+
+    int n;
+    vector<vector<int> > vars, elems;
+    vector<int> weight, degree;
+    vector<Status> status;
+    vector<vector<int> > merged; //variables merged into each supervariable
+    vector<int> mark;
+    int tag;
+    vector<int> external, externalTag;
+    vector<int> head, next, prev;
+    int minDegree;
+};
+
+vector<int> SPDMatrix::approximateMinimumDegreeOrder() const
+{
+    return AMDOrdering(m).order();
+}
+
+class DimLess
+{
+public:
+    DimLess(int inDim, const vector<Vector3> &inPositions) : dim(inDim), positions(inPositions) {}
+    bool operator()(int a, int b) const { return positions[a][dim] < positions[b][dim]; }
+private:
+    int dim;
+    const vector<Vector3> &positions;
+};
+
+//Recursively splits the vertices at the median of the longest side of their bounding box, orders
+//the two sides, and then the separator (the vertices of the smaller side that are next to the other)
+static void dissect(vector<int> &verts, const vector<Vector3> &positions, const vector<vector<int> > &adj,
+                    vector<int> &side, vector<int> &out)
+{
+    int i, j;
+    const int leafSize = 8;
+
+    if((int)verts.size() <= leafSize) {
+        out.insert(out.end(), verts.begin(), verts.end());
+        return;
+    }
+
+    Vector3 lo = positions[verts[0]], hi = lo;
+    for(i = 1; i < (int)verts.size(); ++i) {
+        for(j = 0; j < 3; ++j) {
+            lo[j] = min(lo[j], positions[verts[i]][j]);
+            hi[j] = max(hi[j], positions[verts[i]][j]);
+        }
+    }
+    Vector3 extent = hi - lo;
+    int axis = (extent[0] > extent[1]) ? (extent[0] > extent[2] ? 0 : 2) : (extent[1] > extent[2] ? 1 : 2);
+
+    int half = verts.size() / 2;
+    nth_element(verts.begin(), verts.begin() + half, verts.end(), DimLess(axis, positions));
+
+    //side: 1 for the first half, 2 for the second, 3 for the separator, 0 for other vertices
+    for(i = 0; i < (int)verts.size(); ++i)
+        side[verts[i]] = (i < half) ? 1 : 2;
+    vector<int> bound[2];
+    for(i = 0; i < (int)verts.size(); ++i) {
+        int v = verts[i];
+        for(j = 0; j < (int)adj[v].size(); ++j) {
+            int s = side[adj[v][j]];
+            if(s != 0 && s != side[v]) {
+                bound[side[v] - 1].push_back(v);
+                break;
+            }
+        }
+    }
+    vector<int> &sep = bound[bound[0].size() <= bound[1].size() ? 0 : 1];
+    for(i = 0; i < (int)sep.size(); ++i)
+        side[sep[i]] = 3;
+
+    vector<int> parts[2];
+    for(i = 0; i < (int)verts.size(); ++i) {
+        int s = side[verts[i]];
+        side[verts[i]] = 0;
+        if(s != 3)
+            parts[s - 1].push_back(verts[i]);
+    }
+    vector<int>().swap(verts);
+
+    dissect(parts[0], positions, adj, side, out);
+    dissect(parts[1], positions, adj, side, out);
+    out.insert(out.end(), sep.begin(), sep.end());
+}
+
+vector<int> SPDMatrix::nestedDissectionOrder() const
+{
+    int i, j;
+    int sz = m.size();
+    vector<vector<int> > adj(sz);
+    for(i = 0; i < sz; ++i) {
+        for(j = 0; j < (int)m[i].size(); ++j) {
+            int k = m[i][j].first;
+            if(k != i) {
+                adj[i].push_back(k);
+                adj[k].push_back(i);
+            }
+        }
+    }
+
+    vector<int> verts(sz), side(sz, 0), out;
+    for(i = 0; i < sz; ++i)
+        verts[i] = i;
+    out.reserve(sz);
+    dissect(verts, positions, adj, side, out);
     return out;
 }
 
 LLTMatrix *SPDMatrix::factor() const
+{
+    if(!supernodal)
+        return factorByRows();
+
+    Debugging::out() << "Factoring size = " << m.size() << endl;
+
+    SymbolicFactor symbolic;
+    analyze(symbolic);
+    return factorNumeric(symbolic);
+}
+
+LLTMatrix *SPDMatrix::factorByRows() const
 {
     int i, j, k;
     MyLLTMatrix *outP = new MyLLTMatrix();
@@ -295,6 +733,11 @@ LLTMatrix *SPDMatrix::factor() const
         dinv[i] = 1. / out.diag[i];
     }
 
+    size_t nonzeros = sz;
+    for(i = 0; i < sz; ++i)
+        nonzeros += out.m[i].size();
+    Debugging::out() << "Nonzeros in factor: " << nonzeros << endl;
+
     out.initMt();
 
     /* Error check 
@@ -369,4 +812,566 @@ bool MyLLTMatrix::solve(vector<double> &b) const
 
     return true;
 }
+
+//Solves for the width right hand sides interleaved in bp (already permuted).  Every factor entry
+//is loaded once and applied to all of them.  Width is the compile-time width, if it is known (0
+//otherwise), so that the inner loops can be unrolled and vectorized.
+template<int Width>
+void MyLLTMatrix::solveBlock(double *bp, int width) const
+{
+    int i, j, c;
+    int sz = m.size();
+    if(Width > 0)
+        width = Width;
+
+    //solve L (L^T x) = b for (L^T x)
+    for(i = 0; i < sz; ++i) {
+        double *cur = bp + i * width;
+        for(j = 0; j < (int)m[i].size(); ++j) {
+            const double *other = bp + m[i][j].first * width;
+            double val = m[i][j].second;
+            for(c = 0; c < width; ++c)
+                cur[c] -= other[c] * val;
+        }
+        for(c = 0; c < width; ++c)
+            cur[c] /= diag[i];
+    }
+
+    //solve L^T x = b for x
+    for(i = sz - 1; i >= 0; --i) {
+        double *cur = bp + i * width;
+        for(j = 0; j < (int)mt[i].size(); ++j) {
+            const double *other = bp + mt[i][j].first * width;
+            double val = mt[i][j].second;
+            for(c = 0; c < width; ++c)
+                cur[c] -= other[c] * val;
+        }
+        for(c = 0; c < width; ++c)
+            cur[c] /= diag[i];
+    }
+}
+
+bool MyLLTMatrix::solveMany(double *B, int nrhs) const
+{
+    int i, c, start;
+    int sz = m.size();
+
+    vector<double> bp;
+    for(start = 0; start < nrhs; start += blockWidth) {
+        int width = min(blockWidth, nrhs - start);
+        bp.resize(sz * width);
+
+        //permute
+        for(i = 0; i < sz; ++i)
+            for(c = 0; c < width; ++c)
+                bp[perm[i] * width + c] = B[i * nrhs + start + c];
+
+        if(sz > 0) {
+            switch(width) {
+            case 1: solveBlock<1>(&bp[0], width); break;
+            case 2: solveBlock<2>(&bp[0], width); break;
+            case 4: solveBlock<4>(&bp[0], width); break;
+            case 8: solveBlock<8>(&bp[0], width); break;
+            case 16: solveBlock<16>(&bp[0], width); break;
+            default: solveBlock<0>(&bp[0], width); break;
+            }
+        }
+
+        //unpermute
+        for(i = 0; i < sz; ++i)
+            for(c = 0; c < width; ++c)
+                B[i * nrhs + start + c] = bp[perm[i] * width + c];
+    }
+
+    return true;
+}
+
+/**
+* The factor stored as supernodes: runs of columns that have the same structure below the diagonal
+* (up to some explicit zeros, which analyze allows to make the runs longer).
+* Each one is a dense column-major block whose rows are the supernode's own columns followed by the
+* rows below them that are nonzero.
+*/
+class SupernodalLLTMatrix : public LLTMatrix
+{
+public:
+    bool solve(vector<double> &b) const;
+    bool solveMany(double *B, int nrhs) const;
+    int size() const { return perm.size(); }
+
+private:
+    template<int Width> void solveBlock(double *bp, int width) const;
+
+    vector<int> perm; //permutation
+    vector<int> first; //first column of each supernode (and the size at the end)
+    vector<int> rowStart; //where each supernode's rows start in rows (and the end)
+    vector<int> rows;
+    vector<int> valStart; //where each supernode's block starts in values
+    vector<double> values;
+
+    friend class SPDMatrix;
+};
+
+//Factors the block of a supernode in place: lower triangle of the w x w diagonal block and the
+//nr - w rows below it, column-major with nr rows.  It is done in panels of columns: a panel is
+//factored, and its columns are then applied to each later column while that column is in cache.
+static bool factorBlock(double *block, int nr, int w)
+{
+    const int panel = 16;
+    int c, c2, k, i;
+
+    for(int start = 0; start < w; start += panel) {
+        int end = min(w, start + panel);
+
+        for(c = start; c < end; ++c) { //within the panel
+            double *col = block + c * nr;
+            if(col[c] <= 0.)
+                return false;
+            col[c] = sqrt(col[c]);
+            double inv = 1. / col[c];
+            for(i = c + 1; i < nr; ++i)
+                col[i] *= inv;
+            for(c2 = c + 1; c2 < end; ++c2) {
+                double *col2 = block + c2 * nr;
+                double val = col[c2];
+                for(i = c2; i < nr; ++i)
+                    col2[i] -= col[i] * val;
+            }
+        }
+
+        for(c2 = end; c2 < w; ++c2) { //the rest
+            double *col2 = block + c2 * nr;
+            for(k = start; k < end; ++k) {
+                const double *col = block + k * nr;
+                double val = col[c2];
+                for(i = c2; i < nr; ++i)
+                    col2[i] -= col[i] * val;
+            }
+        }
+    }
+    return true;
+}
+
+//a postorder of the forest given by parent: children come before their parents and each subtree
+//is contiguous.  The child with the largest weight is visited last, so it is right before its parent.
+static vector<int> postorder(const vector<int> &parent, const vector<int> &weight)
+{
+    int i;
+    int sz = parent.size();
+    vector<int> head(sz, -1), next(sz, -1), out, stack;
+    for(i = sz - 1; i >= 0; --i) {
+        if(parent[i] >= 0) {
+            next[i] = head[parent[i]];
+            head[parent[i]] = i;
+        }
+    }
+    for(i = 0; i < sz; ++i) { //move the heaviest child to the end of each list
+        if(head[i] < 0 || next[head[i]] < 0)
+            continue;
+        int heaviest = head[i], prev = -1, last = -1;
+        for(int c = head[i], p = -1; c >= 0; p = c, c = next[c]) {
+            if(weight[c] > weight[heaviest]) {
+                heaviest = c;
+                prev = p;
+            }
+            last = c;
+        }
+        if(heaviest == last)
+            continue;
+        if(prev < 0)
+            head[i] = next[heaviest];
+        else
+            next[prev] = next[heaviest];
+        next[last] = heaviest;
+        next[heaviest] = -1;
+    }
+    for(i = 0; i < sz; ++i) {
+        if(parent[i] >= 0)
+            continue;
+        stack.push_back(i);
+        while(!stack.empty()) {
+            int cur = stack.back();
+            if(head[cur] >= 0) {
+                stack.push_back(head[cur]);
+                head[cur] = next[head[cur]];
+            }
+            else {
+                stack.pop_back();
+                out.push_back(cur);
+            }
+        }
+    }
+    return out;
+}
+
+void SPDMatrix::analyze(SymbolicFactor &out) const
+{
+    int i, j, k;
+    int sz = m.size();
+    out = SymbolicFactor();
+
+    out.perm = computePerm();
+
+    Debugging::out() << "Perm computed" << endl;
+
+    //the pattern of the permuted matrix below the diagonal, by rows
+    vector<vector<int> > pr(sz);
+    for(i = 0; i < sz; ++i) {
+        for(j = 0; j < (int)m[i].size(); ++j) {
+            int ni = out.perm[i], nj = out.perm[m[i][j].first];
+            if(ni < nj)
+                swap(ni, nj);
+            if(ni != nj)
+                pr[ni].push_back(nj);
+        }
+    }
+
+    //elimination tree
+    vector<int> &parent = out.parent;
+    vector<int> ancestor(sz, -1);
+    parent.assign(sz, -1);
+    for(i = 0; i < sz; ++i) {
+        for(j = 0; j < (int)pr[i].size(); ++j) {
+            int cur = pr[i][j];
+            while(ancestor[cur] != -1 && ancestor[cur] != i) { //with path compression
+                int next = ancestor[cur];
+                ancestor[cur] = i;
+                cur = next;
+            }
+            if(ancestor[cur] == -1) {
+                ancestor[cur] = i;
+                parent[cur] = i;
+            }
+        }
+    }
+
+    //the nonzeros of row i of the factor are the tree paths from the row's entries up to i
+    vector<int> colCount(sz, 1), children(sz, 0), mark(sz, -1);
+    for(i = 0; i < sz; ++i) {
+        mark[i] = i;
+        for(j = 0; j < (int)pr[i].size(); ++j) {
+            for(int cur = pr[i][j]; mark[cur] != i; cur = parent[cur]) {
+                ++colCount[cur];
+                mark[cur] = i;
+            }
+        }
+        if(parent[i] >= 0)
+            ++children[parent[i]];
+    }
+
+    //renumber by a postorder of the tree (which has the same fill), so that every column comes
+    //right after one of its children--the one with the most nonzeros, which is the cheapest to merge
+    vector<int> post = postorder(parent, colCount);
+    vector<int> newIndex(sz);
+    for(i = 0; i < sz; ++i)
+        newIndex[post[i]] = i;
+    bool renumber = false;
+    for(i = 0; i < sz; ++i)
+        renumber = renumber || newIndex[i] != i;
+    if(renumber) {
+        vector<vector<int> > newPr(sz);
+        vector<int> newParent(sz, -1), newColCount(sz), newChildren(sz);
+        for(i = 0; i < sz; ++i) {
+            newColCount[newIndex[i]] = colCount[i];
+            newChildren[newIndex[i]] = children[i];
+            out.perm[i] = newIndex[out.perm[i]];
+            for(j = 0; j < (int)pr[i].size(); ++j)
+                newPr[newIndex[i]].push_back(newIndex[pr[i][j]]);
+            if(parent[i] >= 0)
+                newParent[newIndex[i]] = newIndex[parent[i]];
+        }
+        pr.swap(newPr);
+        parent.swap(newParent);
+        colCount.swap(newColCount);
+        children.swap(newChildren);
+    }
+
+    //fundamental supernodes: a column joins the previous one if it is its only child and the
+    //structures match
+    vector<int> fundamental;
+    for(i = 0; i < sz; ++i)
+        if(i == 0 || parent[i - 1] != i || children[i] != 1 || colCount[i - 1] != colCount[i] + 1)
+            fundamental.push_back(i);
+    fundamental.push_back(sz);
+
+    //relaxed amalgamation: a supernode also absorbs the one right before it if that is its child
+    //(so its structure is contained in the merged one) and the merged block stays narrow or
+    //mostly nonzeros--the explicit zeros are stored and computed with
+    const double maxZeros = 0.1; //fraction of the merged block
+    const int alwaysMerge = 4; //merged blocks this wide or less have no bound on zeros
+    double groupNonzeros = 0.;
+    for(k = 0; k + 1 < (int)fundamental.size(); ++k) {
+        int f = fundamental[k], l = fundamental[k + 1];
+        double nonzeros = 0.;
+        for(i = f; i < l; ++i)
+            nonzeros += colCount[i];
+        if(f > 0 && parent[f - 1] == f) {
+            double w = l - out.first.back(), below = colCount[l - 1] - 1;
+            double entries = w * (w + 1.) * 0.5 + w * below;
+            if(w <= alwaysMerge || entries - groupNonzeros - nonzeros <= maxZeros * entries) {
+                groupNonzeros += nonzeros;
+                continue;
+            }
+        }
+        out.first.push_back(f);
+        groupNonzeros = nonzeros;
+    }
+    int numSuper = out.first.size();
+    out.first.push_back(sz);
+
+    vector<int> &super = out.super;
+    super.resize(sz);
+    for(k = 0; k < numSuper; ++k)
+        for(i = out.first[k]; i < out.first[k + 1]; ++i)
+            super[i] = k;
+
+    //supernode structures
+    vector<vector<int> > below(numSuper);
+    vector<int> superMark(numSuper, -1);
+    mark.assign(sz, -1);
+    for(i = 0; i < sz; ++i) {
+        mark[i] = i;
+        for(j = 0; j < (int)pr[i].size(); ++j) {
+            for(int cur = pr[i][j]; mark[cur] != i; cur = parent[cur]) {
+                mark[cur] = i;
+                int s = super[cur];
+                if(superMark[s] != i && i >= out.first[s + 1]) {
+                    superMark[s] = i;
+                    below[s].push_back(i);
+                }
+            }
+        }
+    }
+
+    out.rowStart.push_back(0);
+    for(k = 0; k < numSuper; ++k) {
+        for(i = out.first[k]; i < out.first[k + 1]; ++i)
+            out.rows.push_back(i);
+        out.rows.insert(out.rows.end(), below[k].begin(), below[k].end());
+        out.rowStart.push_back(out.rows.size());
+        out.valStart.push_back(out.numValues);
+        out.numValues += (out.rowStart[k + 1] - out.rowStart[k]) * (out.first[k + 1] - out.first[k]);
+        vector<int>().swap(below[k]);
+    }
+
+    //where the entries of the matrix go (the rows of a supernode are sorted)
+    out.entryStart.push_back(0);
+    for(i = 0; i < sz; ++i) {
+        for(j = 0; j < (int)m[i].size(); ++j) {
+            int ni = out.perm[i], nj = out.perm[m[i][j].first];
+            if(ni < nj)
+                swap(ni, nj);
+            int s = super[nj];
+            const int *rowsBegin = &out.rows[0] + out.rowStart[s], *rowsEnd = &out.rows[0] + out.rowStart[s + 1];
+            int row = lower_bound(rowsBegin, rowsEnd, ni) - rowsBegin;
+            out.entryColumn.push_back(m[i][j].first);
+            out.entryValue.push_back(out.valStart[s] + (nj - out.first[s]) * (rowsEnd - rowsBegin) + row);
+        }
+        out.entryStart.push_back(out.entryColumn.size());
+    }
+
+    size_t nonzeros = 0;
+    for(i = 0; i < sz; ++i)
+        nonzeros += colCount[i];
+    Debugging::out() << "Supernodes: " << numSuper << ", nonzeros in factor: " << nonzeros
+                     << " (" << out.numValues << " stored)" << endl;
+}
+
+LLTMatrix *SPDMatrix::factor(const SymbolicFactor &symbolic) const
+{
+    if(!symbolic.matches(m)) {
+        Debugging::out() << "Symbolic factor does not match" << endl;
+        return factor();
+    }
+
+    Debugging::out() << "Factoring size = " << m.size() << " with a symbolic factor" << endl;
+    return factorNumeric(symbolic);
+}
+
+//Numeric factorization, left-looking: before a supernode is factored, the supernodes that affect
+//it subtract their contributions.  Each supernode waits in the list of the supernode containing
+//its next row below the diagonal.
+LLTMatrix *SPDMatrix::factorNumeric(const SymbolicFactor &symbolic) const
+{
+    int i, j, k, c;
+    int sz = m.size();
+    SupernodalLLTMatrix *outP = new SupernodalLLTMatrix();
+    SupernodalLLTMatrix &out = *outP;
+    out.perm = symbolic.perm;
+    out.first = symbolic.first;
+    out.rowStart = symbolic.rowStart;
+    out.rows = symbolic.rows;
+    out.valStart = symbolic.valStart;
+    const vector<int> &super = symbolic.super;
+    int numSuper = out.first.size() - 1;
+
+    out.values.assign(symbolic.numValues, 0.);
+    for(i = 0; i < sz; ++i) {
+        const int *entryValue = &symbolic.entryValue[0] + symbolic.entryStart[i];
+        for(j = 0; j < (int)m[i].size(); ++j)
+            out.values[entryValue[j]] += m[i][j].second;
+    }
+
+    vector<int> local(sz); //row -> row within the current supernode
+    vector<int> head(numSuper, -1), next(numSuper, -1), nextRow(numSuper);
+    vector<double> update;
+    for(k = 0; k < numSuper; ++k) {
+        int f = out.first[k], l = out.first[k + 1];
+        int w = l - f;
+        const int *rowsK = &out.rows[out.rowStart[k]];
+        int nr = out.rowStart[k + 1] - out.rowStart[k];
+        double *block = &out.values[out.valStart[k]];
+
+        for(i = 0; i < nr; ++i)
+            local[rowsK[i]] = i;
+
+        for(int d = head[k]; d != -1;) {
+            int dNext = next[d];
+            const int *rowsD = &out.rows[out.rowStart[d]];
+            int ndr = out.rowStart[d + 1] - out.rowStart[d];
+            int wd = out.first[d + 1] - out.first[d];
+            const double *blockD = &out.values[out.valStart[d]];
+
+            int p = nextRow[d], q = p;
+            while(q < ndr && rowsD[q] < l)
+                ++q;
+            int m1 = q - p, m2 = ndr - p;
+
+            //update = (rows p..ndr of d) * (rows p..q of d)^T, lower part only
+            update.assign(size_t(m1) * m2, 0.);
+            for(c = 0; c < m1; ++c) {
+                double *uCol = &update[size_t(c) * m2];
+                for(j = 0; j < wd; ++j) {
+                    const double *dCol = blockD + j * ndr + p;
+                    double val = dCol[c];
+                    for(i = c; i < m2; ++i)
+                        uCol[i] -= dCol[i] * val;
+                }
+            }
+            for(c = 0; c < m1; ++c) {
+                double *col = block + (rowsD[p + c] - f) * nr;
+                const double *uCol = &update[size_t(c) * m2];
+                for(i = c; i < m2; ++i)
+                    col[local[rowsD[p + i]]] += uCol[i];
+            }
+
+            nextRow[d] = q;
+            if(q < ndr) {
+                int t = super[rowsD[q]];
+                next[d] = head[t];
+                head[t] = d;
+            }
+            d = dNext;
+        }
+
+        if(!factorBlock(block, nr, w)) { //not positive definite
+            assert(false && "Not positive definite matrix (or ill-conditioned)");
+            delete outP;
+            return new SupernodalLLTMatrix();
+        }
+
+        nextRow[k] = w;
+        if(nr > w) {
+            int t = super[rowsK[w]];
+            next[k] = head[t];
+            head[t] = k;
+        }
+    }
+
+    return outP;
+}
+
+bool SupernodalLLTMatrix::solve(vector<double> &b) const
+{
+    if(b.size() != perm.size())
+        return false;
+    return b.empty() || solveMany(&b[0], 1);
+}
+
+//as in MyLLTMatrix, Width is the compile-time number of right hand sides, if it is known
+template<int Width>
+void SupernodalLLTMatrix::solveBlock(double *bp, int width) const
+{
+    int i, k, c, s;
+    int numSuper = first.size() - 1;
+    if(Width > 0)
+        width = Width;
+
+    //solve L (L^T x) = b for (L^T x), a column at a time
+    for(s = 0; s < numSuper; ++s) {
+        const int *rowsS = &rows[rowStart[s]];
+        int nr = rowStart[s + 1] - rowStart[s];
+        int f = first[s], w = first[s + 1] - f;
+        const double *block = &values[valStart[s]];
+
+        for(c = 0; c < w; ++c) {
+            const double *col = block + c * nr;
+            double *cur = bp + (f + c) * width;
+            for(k = 0; k < width; ++k)
+                cur[k] /= col[c];
+            for(i = c + 1; i < nr; ++i) {
+                double *other = bp + rowsS[i] * width;
+                double val = col[i];
+                for(k = 0; k < width; ++k)
+                    other[k] -= cur[k] * val;
+            }
+        }
+    }
+
+    //solve L^T x = b for x
+    for(s = numSuper - 1; s >= 0; --s) {
+        const int *rowsS = &rows[rowStart[s]];
+        int nr = rowStart[s + 1] - rowStart[s];
+        int f = first[s], w = first[s + 1] - f;
+        const double *block = &values[valStart[s]];
+
+        for(c = w - 1; c >= 0; --c) {
+            const double *col = block + c * nr;
+            double *cur = bp + (f + c) * width;
+            for(i = c + 1; i < nr; ++i) {
+                const double *other = bp + rowsS[i] * width;
+                double val = col[i];
+                for(k = 0; k < width; ++k)
+                    cur[k] -= other[k] * val;
+            }
+            for(k = 0; k < width; ++k)
+                cur[k] /= col[c];
+        }
+    }
+}
+
+bool SupernodalLLTMatrix::solveMany(double *B, int nrhs) const
+{
+    int i, c, start;
+    int sz = perm.size();
+
+    vector<double> bp;
+    for(start = 0; start < nrhs; start += blockWidth) {
+        int width = min(blockWidth, nrhs - start);
+        bp.resize(sz * width);
+
+        //permute
+        for(i = 0; i < sz; ++i)
+            for(c = 0; c < width; ++c)
+                bp[perm[i] * width + c] = B[i * nrhs + start + c];
+
+        if(sz > 0) {
+            switch(width) {
+            case 1: solveBlock<1>(&bp[0], width); break;
+            case 2: solveBlock<2>(&bp[0], width); break;
+            case 4: solveBlock<4>(&bp[0], width); break;
+            case 8: solveBlock<8>(&bp[0], width); break;
+            case 16: solveBlock<16>(&bp[0], width); break;
+            default: solveBlock<0>(&bp[0], width); break;
+            }
+        }
+
+        //unpermute
+        for(i = 0; i < sz; ++i)
+            for(c = 0; c < width; ++c)
+                B[i * nrhs + start + c] = bp[perm[i] * width + c];
+    }
+
+    return true;
+}
 #endif
@@ -25,6 +25,7 @@
 #include <assert.h>
 
 #include "mathutils.h"
+#include "vector.h"
 
 /**
 * Represents a factored spd matrix -- primary intended use is inside LSQSystem
@@ -32,9 +33,52 @@
 class LLTMatrix
 {
 public:
+    LLTMatrix() : blockWidth(8) {}
     virtual ~LLTMatrix() {}
     virtual bool solve(vector<double> &b) const = 0;
     virtual int size() const = 0;
+
+    //Solves for nrhs right hand sides in place.  They are interleaved: B[i * nrhs + r] is entry i of
+    //right hand side r.  The factor is traversed once per blockWidth right hand sides, instead of once
+    //per right hand side as with solve().
+    virtual bool solveMany(double *B, int nrhs) const;
+    void setBlockWidth(int inBlockWidth) { blockWidth = max(1, inBlockWidth); }
+    int getBlockWidth() const { return blockWidth; }
+
+protected:
+    int blockWidth;
+};
+
+/**
+* The part of a (supernodal) Cholesky factorization that only depends on the nonzero pattern of the
+* matrix: the fill-reducing permutation, the elimination tree and the structure of the factor.
+* Matrices with the same pattern, such as Laplacians of meshes with the same connectivity, can share
+* it and only be factored numerically.  It is computed by SPDMatrix::analyze.
+*/
+class PINOCCHIO_API SymbolicFactor
+{
+public:
+    SymbolicFactor() : numValues(0) {}
+
+    int size() const { return perm.size(); }
+    bool empty() const { return perm.empty(); }
+    bool matches(const vector<vector<pair<int, double> > > &m) const; //whether m has the pattern
+
+private:
+    vector<int> perm; //permutation
+    vector<int> parent; //elimination tree (of the permuted matrix)
+    vector<int> super; //supernode of each column
+    vector<int> first; //first column of each supernode (and the size at the end)
+    vector<int> rowStart; //where each supernode's rows start in rows (and the end)
+    vector<int> rows;
+    vector<int> valStart; //where each supernode's block starts in the values
+    int numValues;
+
+    vector<int> entryStart; //where each row of the matrix starts in the lists below (and the end)
+    vector<int> entryColumn; //column of each entry of the matrix, in the order given
+    vector<int> entryValue; //where each entry of the matrix goes in the values
+
+    friend class SPDMatrix;
 };
 
 /**
@@ -45,11 +89,39 @@ public:
 class SPDMatrix
 {
 public:
-    SPDMatrix(const vector<vector<pair<int, double> > > &inM) : m(inM) {}
+    //fill-reducing orderings: the original greedy minimum degree, approximate minimum degree (much
+    //faster, and less fill on meshes), and nested dissection by coordinates (needs setPositions)
+    enum Ordering { MINIMUM_DEGREE, APPROXIMATE_MINIMUM_DEGREE, NESTED_DISSECTION };
+
+    SPDMatrix(const vector<vector<pair<int, double> > > &inM)
+        : supernodal(true), ordering(APPROXIMATE_MINIMUM_DEGREE), m(inM) {}
     LLTMatrix *factor() const;
 
+    //Computes the symbolic factorization into out (with the current ordering).  It can then be used
+    //to factor this matrix, or any other with the same pattern, without ordering or analyzing it again.
+    void analyze(SymbolicFactor &out) const;
+    //numeric supernodal factorization with a symbolic factor (like factor() if it doesn't match)
+    LLTMatrix *factor(const SymbolicFactor &symbolic) const;
+
+    //By default, the factorization is supernodal: columns of the factor with the same structure are
+    //grouped and computed as dense blocks.  Otherwise it is computed one row at a time.
+    void setSupernodal(bool inSupernodal) { supernodal = inSupernodal; }
+
+    void setOrdering(Ordering inOrdering) { ordering = inOrdering; }
+    //a point for each row/column, e.g., the mesh vertex of a Laplacian row, for nested dissection
+    void setPositions(const vector<Vector3> &inPositions) { positions = inPositions; }
+
 private:
     vector<int> computePerm() const; //computes a fill-reduction permutation
+    vector<int> minimumDegreeOrder() const;
+    vector<int> approximateMinimumDegreeOrder() const;
+    vector<int> nestedDissectionOrder() const;
+    LLTMatrix *factorByRows() const;
+    LLTMatrix *factorNumeric(const SymbolicFactor &symbolic) const;
+
+    bool supernodal;
+    Ordering ordering;
+    vector<Vector3> positions;
 
     vector<vector<pair<int, double> > > m; //rows -- lower triangle
 };
@@ -0,0 +1,199 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "optimizer.h"
+
+static double dot(const vector<double> &v1, const vector<double> &v2)
+{
+    double out = 0.;
+    for(int i = 0; i < (int)v1.size(); ++i)
+        out += v1[i] * v2[i];
+    return out;
+}
+
+//minimizer of the cubic matching the values and slopes at steps a and b--if there is none, the
+//midpoint.  The result is kept away from the ends of the interval.
+static double interpolate(double a, double valA, double slopeA, double b, double valB, double slopeB)
+{
+    double out = 0.5 * (a + b);
+    double d1 = slopeA + slopeB - 3. * (valA - valB) / (a - b);
+    double disc = d1 * d1 - slopeA * slopeB;
+    if(disc >= 0.) {
+        double d2 = (b > a ? 1. : -1.) * sqrt(disc);
+        double denom = slopeB - slopeA + 2. * d2;
+        if(denom != 0.)
+            out = b - (b - a) * (slopeB + d2 - d1) / denom;
+    }
+
+    double lo = min(a, b), hi = max(a, b), margin = 0.1 * (hi - lo);
+    if(!(out >= lo + margin && out <= hi - margin)) //also catches NaN
+        out = 0.5 * (a + b);
+    return out;
+}
+
+bool LBFGSOptimizer::lineSearch(Objective &f, vector<double> &x, double &val, vector<double> &grad,
+                                const vector<double> &dir, double step)
+{
+    int i, iter;
+    const int maxProbes = 20;
+    int n = x.size();
+
+    double val0 = val, slope0 = dot(grad, dir);
+    if(slope0 >= 0.)
+        return false;
+
+    vector<double> pt(n), ptGrad(n);
+
+    //the lowest point found so far (with sufficient decrease) and the other end of the bracket
+    double lo = 0., loVal = val0, loSlope = slope0;
+    vector<double> loPt(x), loGrad(grad);
+    double hi = 0., hiVal = 0., hiSlope = 0.;
+    bool bracketed = false;
+
+    for(iter = 0; iter < maxProbes && !outOfEvals(); ++iter) {
+        if(bracketed) {
+            step = interpolate(lo, loVal, loSlope, hi, hiVal, hiSlope);
+            if(fabs(hi - lo) <= 1e-12 * max(1., fabs(lo)))
+                break;
+        }
+
+        for(i = 0; i < n; ++i)
+            pt[i] = x[i] + step * dir[i];
+        double ptVal = gradient(f, pt, ptGrad);
+        double ptSlope = dot(ptGrad, dir);
+
+        if(ptVal > val0 + c1 * step * slope0 || ptVal >= loVal) { //too far
+            hi = step;
+            hiVal = ptVal;
+            hiSlope = ptSlope;
+            bracketed = true;
+            continue;
+        }
+        if(fabs(ptSlope) <= -c2 * slope0) { //strong Wolfe
+            x.swap(pt);
+            grad.swap(ptGrad);
+            val = ptVal;
+            return true;
+        }
+        if(bracketed ? (ptSlope * (hi - lo) >= 0.) : (ptSlope >= 0.)) { //the minimum is behind
+            hi = lo;
+            hiVal = loVal;
+            hiSlope = loSlope;
+            bracketed = true;
+        }
+        lo = step;
+        loVal = ptVal;
+        loSlope = ptSlope;
+        loPt.swap(pt);
+        loGrad.swap(ptGrad);
+        if(!bracketed)
+            step *= 2.;
+    }
+
+    if(lo == 0.)
+        return false;
+    x.swap(loPt); //sufficient decrease, but no curvature condition
+    grad.swap(loGrad);
+    val = loVal;
+    return true;
+}
+
+double LBFGSOptimizer::minimize(Objective &f, vector<double> &x)
+{
+    int i, k;
+    int n = x.size();
+    resetCounts();
+
+    vector<double> grad(n);
+    double val = gradient(f, x, grad);
+
+    vector<vector<double> > s, y; //corrections, oldest first
+    vector<double> rho, alpha;
+    vector<double> dir(n), prevX, prevGrad;
+
+    while(!outOfEvals()) {
+        double gradNorm = sqrt(dot(grad, grad));
+        if(gradNorm <= gradTol || gradNorm == 0.)
+            break;
+
+        //two-loop recursion for the quasi-Newton direction
+        for(i = 0; i < n; ++i)
+            dir[i] = -grad[i];
+        alpha.resize(s.size());
+        for(k = (int)s.size() - 1; k >= 0; --k) {
+            alpha[k] = rho[k] * dot(s[k], dir);
+            for(i = 0; i < n; ++i)
+                dir[i] -= alpha[k] * y[k][i];
+        }
+        if(!s.empty()) {
+            double scale = dot(s.back(), y.back()) / dot(y.back(), y.back());
+            for(i = 0; i < n; ++i)
+                dir[i] *= scale;
+        }
+        for(k = 0; k < (int)s.size(); ++k) {
+            double beta = rho[k] * dot(y[k], dir);
+            for(i = 0; i < n; ++i)
+                dir[i] += (alpha[k] - beta) * s[k][i];
+        }
+
+        double step = 1.;
+        if(s.empty() || dot(dir, grad) >= 0.) { //start over with steepest descent
+            s.clear();
+            y.clear();
+            rho.clear();
+            for(i = 0; i < n; ++i)
+                dir[i] = -grad[i];
+            step = firstStep / gradNorm;
+        }
+
+        prevX = x;
+        prevGrad = grad;
+        double prevVal = val;
+        if(!lineSearch(f, x, val, grad, dir, step)) {
+            if(s.empty())
+                break; //not even steepest descent helps
+            s.clear();
+            y.clear();
+            rho.clear();
+            continue;
+        }
+        ++iterations;
+
+        vector<double> ds(n), dy(n);
+        for(i = 0; i < n; ++i) {
+            ds[i] = x[i] - prevX[i];
+            dy[i] = grad[i] - prevGrad[i];
+        }
+        double sy = dot(ds, dy);
+        if(sy > 1e-10 * sqrt(dot(ds, ds) * dot(dy, dy))) { //skip corrections that aren't positive definite
+            if((int)s.size() >= memory) {
+                s.erase(s.begin());
+                y.erase(y.begin());
+                rho.erase(rho.begin());
+            }
+            s.push_back(ds);
+            y.push_back(dy);
+            rho.push_back(1. / sy);
+        }
+
+        if(prevVal - val <= relTol * fabs(prevVal))
+            break;
+    }
+
+    return val;
+}
@@ -0,0 +1,96 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef OPTIMIZER_H_INCLUDED
+#define OPTIMIZER_H_INCLUDED
+
+#include <vector>
+#include <algorithm>
+
+#include "mathutils.h"
+
+/**
+* A function to be minimized over a vector of variables
+*/
+class Objective
+{
+public:
+    virtual ~Objective() {}
+    virtual double value(const vector<double> &x) = 0;
+    virtual double gradient(const vector<double> &x, vector<double> &grad) = 0; //also returns the value
+};
+
+/**
+* Base class for unconstrained minimizers.  Subclasses implement minimize and call value and
+* gradient below, which count the evaluations and enforce the budget.  Zero for any of the
+* stopping rules means it is not used.
+*/
+class PINOCCHIO_API Optimizer
+{
+public:
+    Optimizer() : maxEvals(0), gradTol(0.), relTol(0.), valueEvals(0), gradientEvals(0), iterations(0) {}
+    virtual ~Optimizer() {}
+
+    //improves x and returns the value there
+    virtual double minimize(Objective &f, vector<double> &x) = 0;
+    virtual Optimizer *clone() const = 0; //e.g., for one minimization per thread
+
+    int maxEvals; //stop after this many evaluations (a gradient counts as one)
+    double gradTol; //stop when the gradient norm is below this
+    double relTol; //stop when an iteration decreases the value by less than this fraction of it
+
+    int getValueEvals() const { return valueEvals; }
+    int getGradientEvals() const { return gradientEvals; }
+    int getIterations() const { return iterations; }
+
+protected:
+    double value(Objective &f, const vector<double> &x) { ++valueEvals; return f.value(x); }
+    double gradient(Objective &f, const vector<double> &x, vector<double> &grad)
+    { ++gradientEvals; return f.gradient(x, grad); }
+
+    bool outOfEvals() const { return maxEvals > 0 && valueEvals + gradientEvals >= maxEvals; }
+    void resetCounts() { valueEvals = gradientEvals = iterations = 0; }
+
+    int valueEvals, gradientEvals, iterations;
+};
+
+/**
+* Limited memory BFGS with a line search for the strong Wolfe conditions (Nocedal and Wright,
+* Numerical Optimization, algorithms 7.4, 3.5 and 3.6)
+*/
+class PINOCCHIO_API LBFGSOptimizer : public Optimizer
+{
+public:
+    LBFGSOptimizer(int inMemory = 8) : memory(inMemory), c1(1e-4), c2(0.9), firstStep(0.001) {}
+
+    double minimize(Objective &f, vector<double> &x);
+    Optimizer *clone() const { return new LBFGSOptimizer(*this); }
+
+    int memory; //number of corrections kept
+    double c1, c2; //sufficient decrease and curvature constants of the Wolfe conditions
+    double firstStep; //length of the first step, before there is curvature information
+
+private:
+    //Finds a step along dir satisfying the strong Wolfe conditions.  On input, val and grad are
+    //at x; on output, x, val and grad are at the new point.  Returns false if no step decreased
+    //the value enough (x is then unchanged).
+    bool lineSearch(Objective &f, vector<double> &x, double &val, vector<double> &grad,
+                    const vector<double> &dir, double step);
+};
+
+#endif //OPTIMIZER_H_INCLUDED
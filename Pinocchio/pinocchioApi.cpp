@@ -18,11 +18,21 @@
 
 #include "pinocchioApi.h"
 #include "debugging.h"
+#include "lsqSolver.h"
 #include <fstream>
 
 ostream *Debugging::outStream = new ofstream();
 
-PinocchioOutput autorig(const Skeleton &given, const Mesh &m)
+static ostream *threadLog = NULL;
+#pragma omp threadprivate(threadLog)
+
+ostream *&Debugging::threadStream() { return threadLog; }
+
+Debugging::Quiet::Quiet() : stream(&buf), previous(threadStream()) { threadStream() = &stream; }
+Debugging::Quiet::~Quiet() { threadStream() = previous; }
+
+PinocchioOutput autorig(const Skeleton &given, const Mesh &m, const MedialBudget &medialBudget,
+                        const EmbedOptions &embedOptions, Optimizer *optimizer)
 {
     int i;
     PinocchioOutput out;
@@ -35,9 +45,10 @@ PinocchioOutput autorig(const Skeleton &given, const Mesh &m)
     TreeType *distanceField = constructDistanceField(newMesh);
 
     //discretization
-    vector<Sphere> medialSurface = sampleMedialSurface(distanceField);
+    vector<Sphere> medialSurface = sampleMedialSurface(distanceField, medialBudget);
 
-    vector<Sphere> spheres = packSpheres(medialSurface);
+    //the coarse-to-fine search can afford many more spheres
+    vector<Sphere> spheres = packSpheres(medialSurface, embedOptions.coarseSpheres > 0 ? 10000 : 1000);
 
     PtGraph graph = connectSamples(distanceField, spheres);
 
@@ -47,21 +58,34 @@ PinocchioOutput autorig(const Skeleton &given, const Mesh &m)
     //constraints can be set by respecifying possibilities for skeleton joints:
     //to constrain joint i to sphere j, use: possiblities[i] = vector<int>(1, j);
 
-    vector<int> embeddingIndices = discreteEmbed(graph, spheres, given, possibilities);
+    PathSplitCache splitCache; //shared by the discrete embedding and splitPaths
+    EmbedOptions options(embedOptions);
+    options.splitCache = &splitCache;
+    EmbedResult result;
+    vector<int> embeddingIndices = discreteEmbed(graph, spheres, given, possibilities, options, &result);
+    out.penalty = result.penalty;
 
     if(embeddingIndices.size() == 0) { //failure
         delete distanceField;
         return out;
     }
 
-    vector<Vector3> discreteEmbedding = splitPaths(embeddingIndices, graph, given);
-
     //continuous refinement
     vector<Vector3> medialCenters(medialSurface.size());
     for(i = 0; i < (int)medialSurface.size(); ++i)
         medialCenters[i] = medialSurface[i].center;
 
-    out.embedding = refineEmbedding(distanceField, medialCenters, discreteEmbedding, given);
+    if(result.matches.size() > 1) { //keep whichever refines best
+        vector<vector<Vector3> > discreteEmbeddings;
+        for(i = 0; i < (int)result.matches.size(); ++i)
+            discreteEmbeddings.push_back(splitPaths(result.matches[i], graph, given, &splitCache));
+
+        out.embedding = refineBestEmbedding(distanceField, medialCenters, discreteEmbeddings, given, NULL, optimizer);
+    }
+    else {
+        vector<Vector3> discreteEmbedding = splitPaths(embeddingIndices, graph, given, &splitCache);
+        out.embedding = refineEmbedding(distanceField, medialCenters, discreteEmbedding, given, optimizer);
+    }
 
     //attachment
     VisTester<TreeType> *tester = new VisTester<TreeType>(distanceField);
@@ -74,3 +98,80 @@ PinocchioOutput autorig(const Skeleton &given, const Mesh &m)
     return out;
 }
 
+vector<PinocchioOutput> autorigAll(const vector<Skeleton> &given, const Mesh &m, bool attachAll,
+                                   const MedialBudget &medialBudget, const EmbedOptions &embedOptions,
+                                   Optimizer *optimizer)
+{
+    int i, j;
+    int num = given.size();
+    vector<PinocchioOutput> out(num);
+
+    Mesh newMesh = prepareMesh(m);
+
+    if(newMesh.vertices.size() == 0 || num == 0)
+        return out;
+
+    //the stages that only depend on the mesh
+    TreeType *distanceField = constructDistanceField(newMesh);
+    vector<Sphere> medialSurface = sampleMedialSurface(distanceField, medialBudget);
+    vector<Sphere> spheres = packSpheres(medialSurface, embedOptions.coarseSpheres > 0 ? 10000 : 1000);
+    PtGraph graph = connectSamples(distanceField, spheres);
+
+    //Discrete embeddings, one skeleton per thread--they only read the mesh data.  Their logs would
+    //be interleaved, so they are dropped and the results are logged afterwards.
+    vector<vector<vector<Vector3> > > discreteEmbeddings(num); //the best few matches of each skeleton
+
+#pragma omp parallel for schedule(dynamic, 1)
+    for(i = 0; i < num; ++i) {
+        Debugging::Quiet quiet;
+        vector<vector<int> > possibilities = computePossibilities(graph, spheres, given[i]);
+
+        PathSplitCache splitCache;
+        EmbedOptions options(embedOptions);
+        options.splitCache = &splitCache;
+        EmbedResult result;
+        discreteEmbed(graph, spheres, given[i], possibilities, options, &result);
+        out[i].penalty = result.penalty;
+        for(j = 0; j < (int)result.matches.size(); ++j)
+            discreteEmbeddings[i].push_back(splitPaths(result.matches[j], graph, given[i], &splitCache));
+    }
+
+    int best = -1;
+    for(i = 0; i < num; ++i) {
+        Debugging::out() << "Skeleton " << i << ": ";
+        if(out[i].penalty < 0.) {
+            Debugging::out() << "no match" << endl;
+            continue;
+        }
+        Debugging::out() << "penalty = " << out[i].penalty << endl;
+        if(best < 0 || out[i].penalty < out[best].penalty)
+            best = i;
+    }
+    Debugging::out() << "Best skeleton: " << best << endl;
+
+    //continuous refinement (of several matches concurrently, if there are several) and attachment
+    vector<Vector3> medialCenters(medialSurface.size());
+    for(j = 0; j < (int)medialSurface.size(); ++j)
+        medialCenters[j] = medialSurface[j].center;
+
+    VisTester<TreeType> *tester = new VisTester<TreeType>(distanceField);
+    SymbolicFactor symbolic; //the attachments are all to the same mesh
+    for(i = 0; i < num; ++i) {
+        if(discreteEmbeddings[i].empty())
+            continue;
+        if(discreteEmbeddings[i].size() > 1)
+            out[i].embedding = refineBestEmbedding(distanceField, medialCenters, discreteEmbeddings[i], given[i],
+                                                   NULL, optimizer);
+        else
+            out[i].embedding = refineEmbedding(distanceField, medialCenters, discreteEmbeddings[i][0], given[i],
+                                               optimizer);
+        if(attachAll || i == best)
+            out[i].attachment = new Attachment(newMesh, given[i], out[i].embedding, tester, 1., &symbolic);
+    }
+
+    //cleanup
+    delete tester;
+    delete distanceField;
+
+    return out;
+}
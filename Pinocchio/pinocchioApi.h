@@ -22,18 +22,85 @@
 #include "mesh.h"
 #include "quaddisttree.h"
 #include "attachment.h"
+#include "optimizer.h"
 
 struct PinocchioOutput
 {
-    PinocchioOutput() : attachment(NULL) {}
+    PinocchioOutput() : attachment(NULL), penalty(-1.) {}
 
     vector<Vector3> embedding;
     Attachment *attachment; //user responsible for deletion
+    double penalty; //of the best discrete embedding (lower is a better fit), -1 if there is none
+};
+
+//limits on medial surface sampling (zero means no limit)--useful for dense distance fields,
+//where most samples are thrown away when the spheres are packed
+struct MedialBudget
+{
+    explicit MedialBudget(int inMaxSamples = 0, double inMaxSeconds = 0.)
+        : maxSamples(inMaxSamples), maxSeconds(inMaxSeconds) {}
+
+    int maxSamples;
+    double maxSeconds;
+};
+
+class PathSplitCache;
+
+//how discreteEmbed searches
+struct EmbedOptions
+{
+    EmbedOptions() : parallel(false), batchSize(1), pathCacheBytes(0), maxSeconds(0.), maxQueue(0), beamWidth(8),
+                     coarseSpheres(0), numMatches(1), splitCache(NULL) {}
+
+    bool parallel; //score the children of expanded matches on all threads (same result as serial)
+    int batchSize; //expand this many of the best matches at a time, in parallel (k-best-first search)
+    //Memory for shortest paths in the graph (0 means 64 MB).  If the matrix of all of them
+    //(AllShortestPather::matrixBytes) fits, it is computed up front, in parallel, and shared by the
+    //threads.  Otherwise each thread computes paths as needed and keeps at most this much of them.
+    size_t pathCacheBytes;
+
+    //Limits on the search (0 means no limit).  Once half of maxSeconds has passed or the queue holds
+    //maxQueue partial matches, the search finishes with a beam search of width beamWidth from the
+    //best partial matches so far, which may not find the optimal match.  After maxSeconds, it only
+    //completes a single match.
+    double maxSeconds;
+    int maxQueue;
+    int beamWidth;
+
+    //If positive and the graph has more spheres than this, neighboring spheres are merged (repeatedly,
+    //roughly halving the graph each time, until there are at most this many), the skeleton is embedded
+    //into the coarse graph, and each joint is then only matched to spheres near its coarse position.
+    //maxSeconds is for all the levels together (half of what is left goes to the coarser levels), and
+    //maxQueue applies to each level; without maxQueue, searches near a coarse match stop at 4096
+    //queued matches.  Much faster on large graphs, but the match may not be optimal.  autorig packs up
+    //to 10000 spheres instead of 1000 when this is set.
+    int coarseSpheres;
+
+    //The search goes on until it has the numMatches best matches (in EmbedResult::matches).  autorig
+    //then refines all of them concurrently and keeps the one with the lowest fine error, which is
+    //sometimes not the best discrete match (e.g., with the legs swapped).
+    int numMatches;
+
+    PathSplitCache *splitCache; //to share path splits with splitPaths (a private one is used if NULL)
 };
 
 //calls the other functions and does the whole rigging process
 //see the implementation of this function to find out how to use the individual functions
-PinocchioOutput PINOCCHIO_API autorig(const Skeleton &given, const Mesh &m);
+//the optimizer, if given, is used for the continuous refinement (see refineEmbedding)
+PinocchioOutput PINOCCHIO_API autorig(const Skeleton &given, const Mesh &m,
+                                      const MedialBudget &medialBudget = MedialBudget(),
+                                      const EmbedOptions &embedOptions = EmbedOptions(),
+                                      Optimizer *optimizer = NULL);
+
+//Rigs the mesh with each of the given skeletons (e.g., to find out whether it is a biped or a
+//quadruped): the distance field, medial surface and sphere graph are only computed once and the
+//skeletons are embedded concurrently.  Compare the penalties to pick the best fit.  Only the skeleton
+//with the lowest penalty gets an attachment, unless attachAll is set.  The optimizer is as for autorig.
+vector<PinocchioOutput> PINOCCHIO_API autorigAll(const vector<Skeleton> &given, const Mesh &m,
+                                                 bool attachAll = false,
+                                                 const MedialBudget &medialBudget = MedialBudget(),
+                                                 const EmbedOptions &embedOptions = EmbedOptions(),
+                                                 Optimizer *optimizer = NULL);
 
 //============================================individual steps=====================================
 
@@ -59,6 +126,10 @@ struct Sphere {
 //output is sorted by radius in decreasing order
 vector<Sphere> PINOCCHIO_API sampleMedialSurface(TreeType *distanceField, double tol = defaultTreeTol);
 
+//same, but visits octree leaves largest spheres first and stops when the budget runs out
+vector<Sphere> PINOCCHIO_API sampleMedialSurface(TreeType *distanceField, const MedialBudget &budget,
+                                                 double tol = defaultTreeTol);
+
 //takes sorted medial surface samples and sparsifies the vector
 vector<Sphere> PINOCCHIO_API packSpheres(const vector<Sphere> &samples, int maxSpheres = 1000);
 
@@ -69,17 +140,67 @@ PtGraph PINOCCHIO_API connectSamples(TreeType *distanceField, const vector<Spher
 vector<vector<int> > PINOCCHIO_API computePossibilities(const PtGraph &graph, const vector<Sphere> &spheres,
                                                         const Skeleton &skeleton);
 
+//Remembers how the graph path matched to a bone is split among the joints of the unreduced skeleton
+//(see splitPaths), by (reduced joint, its sphere, its parent's sphere).  Only valid for one graph and
+//skeleton.  Safe to use from several threads: the splits are kept in shards by hash, each with its own
+//lock, and are copied in and out without holding it.
+class PINOCCHIO_API PathSplitCache
+{
+public:
+    PathSplitCache();
+    ~PathSplitCache();
+
+    bool find(int joint, int sphere, int parentSphere, vector<Vector3> &pts) const; //false if not known
+    void insert(int joint, int sphere, int parentSphere, const vector<Vector3> &pts); //keeps the first one
+
+    int getHits() const;
+    int getMisses() const;
+
+private:
+    PathSplitCache(const PathSplitCache &); //not copyable
+    PathSplitCache &operator=(const PathSplitCache &);
+
+    struct Shard; //defined in embedding.cpp
+    Shard &shardOf(int joint, int sphere, int parentSphere) const;
+
+    vector<Shard *> shards;
+};
+
+//what discreteEmbed found besides the match
+struct EmbedResult
+{
+    EmbedResult() : penalty(-1.), optimal(false) {}
+
+    double penalty; //of the returned match, -1 if there is none
+    bool optimal; //whether no match can have a lower penalty
+    vector<vector<int> > matches; //the best EmbedOptions::numMatches matches found, the returned one first
+    vector<double> penalties; //of those matches
+};
+
 //finds discrete embedding
 vector<int> PINOCCHIO_API discreteEmbed(const PtGraph &graph, const vector<Sphere> &spheres,
-                                        const Skeleton &skeleton, const vector<vector<int> > &possibilities);
+                                        const Skeleton &skeleton, const vector<vector<int> > &possibilities,
+                                        const EmbedOptions &options = EmbedOptions(), EmbedResult *result = NULL);
 
 //reinserts joints for unreduced skeleton
 vector<Vector3> PINOCCHIO_API splitPaths(const vector<int> &discreteEmbedding, const PtGraph &graph,
-                                         const Skeleton &skeleton);
+                                         const Skeleton &skeleton, PathSplitCache *splitCache = NULL);
 
-//refines embedding
+//refines embedding--by default with a fixed number of steepest descent steps, or with the given
+//optimizer (e.g., an LBFGSOptimizer with stopping rules and an evaluation budget).  Nearest medial
+//surface points are found with a PointGridProjector, which uses a grid where that is faster than a
+//kd-tree, unless medialGrid is false.
 vector<Vector3> PINOCCHIO_API refineEmbedding(TreeType *distanceField, const vector<Vector3> &medialSurface,
-                                              const vector<Vector3> &initialEmbedding, const Skeleton &skeleton);
+                                              const vector<Vector3> &initialEmbedding, const Skeleton &skeleton,
+                                              Optimizer *optimizer = NULL, bool medialGrid = true);
+
+//Refines each of the initial embeddings (e.g., the splitPaths of several matches) concurrently and
+//returns the one that ends up with the lowest error.  Its index is put into chosen.  Each refinement
+//uses its own clone of the optimizer, if one is given.
+vector<Vector3> PINOCCHIO_API refineBestEmbedding(TreeType *distanceField, const vector<Vector3> &medialSurface,
+                                                  const vector<vector<Vector3> > &initialEmbeddings,
+                                                  const Skeleton &skeleton, int *chosen = NULL,
+                                                  Optimizer *optimizer = NULL, bool medialGrid = true);
 
 //to compute the attachment, create a new Attachment object
 
@@ -72,13 +72,14 @@ public:
         initHelper(orders);
     }
 
-    Vec project(const Vec &from) const
+    //if a point is already known (closestSoFar, at squared distance minDistSq), only closer ones
+    //are searched for
+    Vec project(const Vec &from, double minDistSq = 1e37, Vec closestSoFar = Vec()) const
     {
-        double minDistSq = 1e37;
-        Vec closestSoFar;
-
+        //The tree is balanced and each step pops a node and pushes at most its two children, so
+        //the stack never holds more than the depth plus one nodes.  Not static, for threads.
         int sz = 1;
-        static pair<double, int> todo[10000];
+        pair<double, int> todo[128];
         todo[0] = make_pair(rnodes[0].rect.distSqTo(from), 0);
 
         while(sz > 0) {
@@ -102,7 +103,7 @@ public:
                 if(sz >= 2 && todo[sz - 1].first > todo[sz - 2].first) {
                     swap(todo[sz - 1], todo[sz - 2]);
                 }
-                if(sz > 9995) {//getting close to our array limit
+                if(sz > 123) {//getting close to our array limit
                     Debugging::out() << "Large todo list, likely to fail" << endl;
                 }
                 continue;
@@ -182,4 +183,141 @@ private:
     vector<RNode> rnodes;
     vector<Obj> objs;
 };
+
+/**
+* Nearest point queries by lookup in a uniform grid of buckets.  The cells are sized from the number
+* of points (a few per occupied cell), and a query scans the cells around its own in growing rings
+* until no unscanned cell can hold a closer point.  Queries that get two rings out without that
+* (starting from the closest point found), and all queries if the grid is turned off or the points
+* are too unevenly spread for a grid, go to an ObjectProjector.  Gives the same points as an ObjectProjector (up to ties).
+*/
+class PointGridProjector
+{
+public:
+    PointGridProjector() : cellSize(1.) { res[0] = res[1] = res[2] = 0; }
+    PointGridProjector(const vector<Vector3> &inPoints, bool useGrid = true) : points(inPoints), cellSize(1.)
+    {
+        res[0] = res[1] = res[2] = 0;
+        vector<Vec3Object> objs(points.begin(), points.end());
+        projector = ObjectProjector<3, Vec3Object>(objs);
+        if(useGrid && !points.empty())
+            makeGrid();
+    }
+
+    Vector3 project(const Vector3 &from) const
+    {
+        const int maxRing = 2;
+        int i, c[3];
+        if(cellStart.empty())
+            return projector.project(from);
+
+        //distance from the query to the sides of its cell--points in ring r are at least that plus
+        //r - 1 cells away
+        double toSide = cellSize;
+        for(i = 0; i < 3; ++i) {
+            double x = (from[i] - lo[i]) / cellSize;
+            c[i] = (int)floor(x);
+            if(c[i] < -maxRing || c[i] >= res[i] + maxRing)
+                return projector.project(from);
+            toSide = min(toSide, min(x - c[i], c[i] + 1 - x) * cellSize);
+        }
+
+        double minDistSq = 1e37;
+        int closest = -1;
+        for(int r = 0; r <= maxRing; ++r) {
+            int x, y, z;
+            for(z = max(0, c[2] - r); z <= min(res[2] - 1, c[2] + r); ++z) {
+                for(y = max(0, c[1] - r); y <= min(res[1] - 1, c[1] + r); ++y) {
+                    bool side = abs(z - c[2]) == r || abs(y - c[1]) == r; //otherwise only the ends in x
+                    int step = side ? 1 : 2 * r;
+                    for(x = c[0] - r; x <= c[0] + r; x += step) {
+                        if(x < 0 || x >= res[0])
+                            continue;
+                        int cell = x + res[0] * (y + res[1] * z);
+                        for(i = cellStart[cell]; i < cellStart[cell + 1]; ++i) {
+                            double distSq = (points[cellPoints[i]] - from).lengthsq();
+                            if(distSq <= minDistSq) {
+                                minDistSq = distSq;
+                                closest = cellPoints[i];
+                            }
+                        }
+                    }
+                }
+            }
+            if(closest >= 0 && minDistSq <= SQR(toSide + r * cellSize))
+                return points[closest];
+        }
+        if(closest >= 0)
+            return projector.project(from, minDistSq, points[closest]);
+        return projector.project(from);
+    }
+
+    bool hasGrid() const { return !cellStart.empty(); }
+
+private:
+    void makeGrid()
+    {
+        int i;
+        const double pointsPerCell = 4.; //in occupied cells
+        const double maxCrowding = 16.; //more points per occupied cell than this, and the grid is not used
+        int n = points.size();
+        int maxCells = 32768 + 8 * n;
+
+        Rect3 box(points.begin(), points.end());
+        Vector3 size = box.getSize();
+        double maxSize = max(1e-10, max(size[0], max(size[1], size[2])));
+        lo = box.getLo();
+
+        //start as if the points filled the box and refine while the occupied cells are crowded
+        //(typical of points on a surface), as far as maxCells allows
+        int numCells = 0, occupied = 0;
+        cellSize = maxSize / max(1., pow(n / pointsPerCell, 1. / 3.));
+        for(int iter = 0; iter < 8; ++iter) {
+            for(i = 0; i < 3; ++i)
+                res[i] = (int)(size[i] / cellSize) + 1;
+            numCells = res[0] * res[1] * res[2];
+
+            cellStart.assign(numCells + 1, 0);
+            for(i = 0; i < n; ++i)
+                ++cellStart[cellOf(points[i]) + 1];
+            occupied = 0;
+            for(i = 0; i < numCells; ++i)
+                occupied += (cellStart[i + 1] > 0);
+
+            //for points on a surface, the occupied cells grow as the square of the refinement
+            double refine = min(sqrt(double(n) / double(occupied) / pointsPerCell),
+                                pow(double(maxCells) / double(numCells), 1. / 3.));
+            if(refine < 1.25)
+                break;
+            cellSize /= refine;
+        }
+        if(double(n) / double(occupied) > maxCrowding) {
+            vector<int>().swap(cellStart);
+            return;
+        }
+
+        for(i = 0; i < numCells; ++i)
+            cellStart[i + 1] += cellStart[i];
+        vector<int> fill(cellStart.begin(), cellStart.end() - 1);
+        cellPoints.resize(n);
+        for(i = 0; i < n; ++i)
+            cellPoints[fill[cellOf(points[i])]++] = i;
+    }
+
+    int cellOf(const Vector3 &v) const
+    {
+        int c[3];
+        for(int i = 0; i < 3; ++i)
+            c[i] = max(0, min(res[i] - 1, (int)floor((v[i] - lo[i]) / cellSize)));
+        return c[0] + res[0] * (c[1] + res[1] * c[2]);
+    }
+
+    vector<Vector3> points;
+    ObjectProjector<3, Vec3Object> projector; //for queries away from the points
+    Vector3 lo;
+    double cellSize;
+    int res[3];
+    vector<int> cellStart, cellPoints; //points in cell i are cellPoints[cellStart[i]...cellStart[i + 1] - 1]
+};
+
 #endif
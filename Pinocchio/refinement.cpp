@@ -19,83 +19,193 @@
 #include "pinocchioApi.h"
 #include "deriv.h"
 #include "debugging.h"
-
+#include "optimizer.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 struct RP //information for refined embedding
 {
-    RP(TreeType *inD, const Skeleton &inSk, const vector<Vector3> &medialSurface)
-        : distanceField(inD), given(inSk)
+    RP(TreeType *inD, const Skeleton &inSk, const vector<Vector3> &medialSurface, bool medialGrid = true)
+        : distanceField(inD), given(inSk), medProjector(medialSurface, medialGrid)
     {
-        vector<Vec3Object> mpts;
-        for(int i = 0; i < (int)medialSurface.size(); ++i)
-            mpts.push_back(medialSurface[i]);
+        int i;
 
-        medProjector = ObjectProjector<3, Vec3Object>(mpts);
+        //bone i (from joint fPrev[i] to joint i) also depends on its symmetric bone's joints
+        dependents.resize(given.fPrev().size());
+        for(i = 1; i < (int)dependents.size(); ++i) {
+            dependents[i].push_back(i);
+            dependents[given.fPrev()[i]].push_back(i);
+            int s = given.fSym()[i];
+            if(s != -1) {
+                dependents[s].push_back(i);
+                dependents[given.fPrev()[s]].push_back(i);
+            }
+        }
     }
 
     TreeType *distanceField;
     const Skeleton &given;
-    ObjectProjector<3, Vec3Object> medProjector;
+    PointGridProjector medProjector;
+    vector<vector<int> > dependents; //the bones whose error terms depend on each joint (may repeat)
 };
 
+//the error term of bone i, which goes from joint fPrev[i] to joint i
+template<class Real> Real computeBoneError(const vector<Vector<Real, 3> > &match, int i, RP *rp)
+{
+    int prev = rp->given.fPrev()[i];
+    
+    Real surfPenalty = Real();
+    Real lenPenalty = Real();
+    Real anglePenalty = Real();
+    Real symPenalty = Real();
+    
+    //-----------------surf
+    const int samples = 10;
+    for(int k = 0; k < samples; ++k) {
+        double frac = double(k) / double(samples);
+        Vector<Real, 3> cur = match[i] * Real(1. - frac) + match[prev] * Real(frac);
+        Vector3 m = rp->medProjector.project(cur);
+        Real medDist = (cur - Vector<Real, 3>(m)).length();
+        Real surfDist = -rp->distanceField->locate(cur)->evaluate(cur);
+        Real penalty = SQR(min(medDist, Real(0.001) + max(Real(0.), Real(0.05) - surfDist)));
+        if(penalty > Real(SQR(0.003)))
+            surfPenalty += Real(1. / double(samples)) * penalty;
+    }
+    
+    //---------------length
+    Real optDistSq = (rp->given.fGraph().verts[i] - rp->given.fGraph().verts[prev]).lengthsq();
+    Real distSq = SQR(max(Real(-10.), (match[i] - match[prev]) *
+                                    (rp->given.fGraph().verts[i] - rp->given.fGraph().verts[prev]))) / optDistSq;
+    lenPenalty = max(Real(.5), (Real(0.0001) + optDistSq) / (Real(0.0001) + distSq));
+    
+    //---------------sym
+    if(rp->given.fSym()[i] != -1) {
+        int s = rp->given.fSym()[i];
+        int sp = rp->given.fPrev()[s];
+        
+        Real sDistSq = (match[s] - match[sp]).lengthsq();
+        symPenalty = max(Real(1.05), max(distSq / (Real(0.001) + sDistSq), sDistSq / (Real(0.001) + distSq)));
+    }
+    
+    //--------------angle
+    if(distSq > Real(1e-16)) {
+        Vector<Real, 3> curDir = (match[i] - match[prev]).normalize();
+        Vector<Real, 3> skelDir = (rp->given.fGraph().verts[i] - rp->given.fGraph().verts[prev]).normalize();
+        if(curDir * skelDir < Real(1. - 1e-8))
+            anglePenalty = Real(0.5) * acos(curDir * skelDir);
+        anglePenalty = CUBE(Real(0.3) + anglePenalty);
+        if(curDir * skelDir < Real(0.))
+            anglePenalty *= 10.;
+    }
+    
+    return Real(15000.) * surfPenalty + Real(0.25) * lenPenalty + Real(2.0) * anglePenalty + symPenalty;
+}
+
 template<class Real> Real computeFineError(const vector<Vector<Real, 3> > &match, RP *rp)
 {
     Real out = Real();
     int i;
-    for(i = 1; i < (int)match.size(); ++i) {
-        int prev = rp->given.fPrev()[i];
-        
-        Real surfPenalty = Real();
-        Real lenPenalty = Real();
-        Real anglePenalty = Real();
-        Real symPenalty = Real();
-        
-        //-----------------surf
-        const int samples = 10;
-        for(int k = 0; k < samples; ++k) {
-            double frac = double(k) / double(samples);
-            Vector<Real, 3> cur = match[i] * Real(1. - frac) + match[prev] * Real(frac);
-            Vector3 m = rp->medProjector.project(cur);
-            Real medDist = (cur - Vector<Real, 3>(m)).length();
-            Real surfDist = -rp->distanceField->locate(cur)->evaluate(cur);
-            Real penalty = SQR(min(medDist, Real(0.001) + max(Real(0.), Real(0.05) - surfDist)));
-            if(penalty > Real(SQR(0.003)))
-                surfPenalty += Real(1. / double(samples)) * penalty;
+    for(i = 1; i < (int)match.size(); ++i)
+        out += computeBoneError(match, i, rp);
+    
+    return out;
+}
+
+//Evaluates computeFineError incrementally: the bone terms of the last embedding are kept, and only
+//the bones that depend on a joint that moved are recomputed.  The terms are summed in the same order,
+//so the result is exactly computeFineError's.  A bone term takes about a microsecond, too little to
+//be worth a parallel region even for a full evaluation (refineBestEmbedding runs whole refinements
+//in parallel instead).
+class FineErrorCache
+{
+public:
+    FineErrorCache(RP *inRp) : rp(inRp) {}
+
+    double evaluate(const vector<Vector3> &newMatch)
+    {
+        int i, j;
+        int sz = newMatch.size();
+
+        toCompute.clear();
+        if((int)match.size() != sz) {
+            terms.assign(sz, 0.);
+            for(i = 1; i < sz; ++i)
+                toCompute.push_back(i);
         }
-        
-        //---------------length
-        Real optDistSq = (rp->given.fGraph().verts[i] - rp->given.fGraph().verts[prev]).lengthsq();
-        Real distSq = SQR(max(Real(-10.), (match[i] - match[prev]) *
-                                        (rp->given.fGraph().verts[i] - rp->given.fGraph().verts[prev]))) / optDistSq;
-        lenPenalty = max(Real(.5), (Real(0.0001) + optDistSq) / (Real(0.0001) + distSq));
-        
-        //---------------sym
-        if(rp->given.fSym()[i] != -1) {
-            int s = rp->given.fSym()[i];
-            int sp = rp->given.fPrev()[s];
-            
-            Real sDistSq = (match[s] - match[sp]).lengthsq();
-            symPenalty = max(Real(1.05), max(distSq / (Real(0.001) + sDistSq), sDistSq / (Real(0.001) + distSq)));
+        else {
+            marked.assign(sz, 0);
+            for(i = 0; i < sz; ++i) {
+                if(match[i] == newMatch[i])
+                    continue;
+                for(j = 0; j < (int)rp->dependents[i].size(); ++j) {
+                    int bone = rp->dependents[i][j];
+                    if(!marked[bone]) {
+                        marked[bone] = 1;
+                        toCompute.push_back(bone);
+                    }
+                }
+            }
         }
-        
-        //--------------angle
-        if(distSq > Real(1e-16)) {
-            Vector<Real, 3> curDir = (match[i] - match[prev]).normalize();
-            Vector<Real, 3> skelDir = (rp->given.fGraph().verts[i] - rp->given.fGraph().verts[prev]).normalize();
-            if(curDir * skelDir < Real(1. - 1e-8))
-                anglePenalty = Real(0.5) * acos(curDir * skelDir);
-            anglePenalty = CUBE(Real(0.3) + anglePenalty);
-            if(curDir * skelDir < Real(0.))
-                anglePenalty *= 10.;
+        match = newMatch;
+
+        for(i = 0; i < (int)toCompute.size(); ++i)
+            terms[toCompute[i]] = computeBoneError(match, toCompute[i], rp);
+
+        double out = 0.;
+        for(i = 1; i < sz; ++i)
+            out += terms[i];
+        return out;
+    }
+
+private:
+    RP *rp;
+    vector<Vector3> match; //the last embedding evaluated
+    vector<double> terms; //its bone terms
+    vector<int> toCompute;
+    vector<char> marked;
+};
+
+//computeFineError over the joint coordinates, with the gradient computed in reverse mode
+class FineObjective : public Objective
+{
+public:
+    FineObjective(RP *inRp, FineErrorCache *inCache) : rp(inRp), cache(inCache) {}
+
+    double value(const vector<double> &x)
+    {
+        int i;
+        vector<Vector3> match(x.size() / 3);
+        for(i = 0; i < (int)match.size(); ++i)
+            match[i] = Vector3(x[i * 3], x[i * 3 + 1], x[i * 3 + 2]);
+        return cache->evaluate(match);
+    }
+
+    double gradient(const vector<double> &x, vector<double> &grad)
+    {
+        int i;
+        tape.clear();
+        vector<Vector<RDeriv<double>, 3> > match(x.size() / 3);
+        for(i = 0; i < (int)match.size(); ++i) {
+            match[i][0] = tape.variable(x[i * 3]);
+            match[i][1] = tape.variable(x[i * 3 + 1]);
+            match[i][2] = tape.variable(x[i * 3 + 2]);
         }
-        
-        out += Real(15000.) * surfPenalty + Real(0.25) * lenPenalty + Real(2.0) * anglePenalty + symPenalty;
+        RDeriv<double> err = computeFineError(match, rp);
+        tape.gradient(err);
+        grad.resize(x.size());
+        for(i = 0; i < (int)x.size(); ++i)
+            grad[i] = tape.getDeriv(i);
+        return err.getReal();
     }
-    
-    return out;
-}
 
-vector<Vector3> optimizeEmbedding1D(vector<Vector3> fineEmbedding, vector<Vector3> dir, RP *rp)
+private:
+    RP *rp;
+    FineErrorCache *cache;
+    Tape<double> tape;
+};
+
+vector<Vector3> optimizeEmbedding1D(vector<Vector3> fineEmbedding, vector<Vector3> dir, FineErrorCache *cache, int &evals)
 {
     int i;
     double step = 0.001;
@@ -109,7 +219,8 @@ vector<Vector3> optimizeEmbedding1D(vector<Vector3> fineEmbedding, vector<Vector
     double prevErr = -1e10;
     int count = 0;
     while(++count) {
-        double curErr = computeFineError(fineEmbedding, rp);
+        double curErr = cache->evaluate(fineEmbedding);
+        ++evals;
         if(prevErr == -1e10 || curErr < prevErr) {
             step *= 2.;
             for(i = 0; i < (int)fineEmbedding.size(); ++i) {
@@ -132,38 +243,71 @@ vector<Vector3> optimizeEmbedding1D(vector<Vector3> fineEmbedding, vector<Vector
 
 
 
-//refines embedding
-vector<Vector3> refineEmbedding(TreeType *distanceField, const vector<Vector3> &medialSurface,
-                                const vector<Vector3> &initialEmbedding, const Skeleton &skeleton)
+//one step along the full gradient with optimizeEmbedding1D (which always moves, even uphill)
+vector<Vector3> gradientStep(const vector<Vector3> &fineEmbedding, FineObjective *objective, FineErrorCache *cache,
+                             int &evals)
 {
-    RP rp(distanceField, skeleton, medialSurface);
+    int i;
+    int sz = fineEmbedding.size();
+    vector<double> x(sz * 3), grad;
+    for(i = 0; i < sz * 3; ++i)
+        x[i] = fineEmbedding[i / 3][i % 3];
+    objective->gradient(x, grad);
+
+    vector<Vector3> dir(sz);
+    for(i = 0; i < sz; ++i)
+        dir[i] = -Vector3(grad[i * 3], grad[i * 3 + 1], grad[i * 3 + 2]);
+    return optimizeEmbedding1D(fineEmbedding, dir, cache, evals);
+}
 
+//refines embedding
+static vector<Vector3> refine(RP &rp, const vector<Vector3> &initialEmbedding, Optimizer *optimizer)
+{
+    const Skeleton &skeleton = rp.given;
     int sz = initialEmbedding.size();
     vector<Vector3> fineEmbedding = initialEmbedding;
     int i, k;
+
+    FineErrorCache cache(&rp);
+    FineObjective objective(&rp, &cache);
+    int evals = 0, gradientEvals = 0;
+
+    if(optimizer) {
+        Debugging::out() << "E = " << cache.evaluate(fineEmbedding) << endl;
+        ++evals;
+
+        //Joints that coincide after splitPaths sit at a discontinuity of the error (the angle
+        //penalty appears once they separate) that a line search will not cross, but the first
+        //steps of the fixed schedule always move.
+        for(k = 0; k < 2; ++k) {
+            fineEmbedding = gradientStep(fineEmbedding, &objective, &cache, evals);
+            ++gradientEvals;
+        }
+
+        vector<double> x(sz * 3);
+        for(i = 0; i < sz * 3; ++i)
+            x[i] = fineEmbedding[i / 3][i % 3];
+
+        double err = optimizer->minimize(objective, x);
+        Debugging::out() << "E = " << err << " after " << optimizer->getIterations() << " iterations, "
+                         << evals + optimizer->getValueEvals() << " error and "
+                         << gradientEvals + optimizer->getGradientEvals() << " gradient evaluations" << endl;
+
+        for(i = 0; i < sz; ++i)
+            fineEmbedding[i] = Vector3(x[i * 3], x[i * 3 + 1], x[i * 3 + 2]);
+        return fineEmbedding;
+    }
+
+    //the original fixed schedule of steepest descent steps
     for(k = 0; k < 10; ++k) {
         typedef Deriv<double, 6> DType;
-        typedef Deriv<double, -1> DType1;
         
-        Debugging::out() << "E = " << computeFineError(fineEmbedding, &rp) << endl;
+        Debugging::out() << "E = " << cache.evaluate(fineEmbedding) << endl;
+        ++evals;
         
         for(int j = 0; j < 2; ++j) {
-            vector<Vector<DType1, 3> > dMatch(sz);
-            for(i = 0; i < sz; ++i) {
-                dMatch[i][0] = DType1(fineEmbedding[i][0], i * 3);
-                dMatch[i][1] = DType1(fineEmbedding[i][1], i * 3 + 1);
-                dMatch[i][2] = DType1(fineEmbedding[i][2], i * 3 + 2);
-            }
-
-            DType1 err = computeFineError(dMatch, &rp) + (DType1() * DType1(0., 3 * sz));
-            vector<Vector3> dir(sz);
-        
-            for(i = 0; i < sz; ++i) {
-                dir[i][0] = -err.getDeriv(i * 3);
-                dir[i][1] = -err.getDeriv(i * 3 + 1);
-                dir[i][2] = -err.getDeriv(i * 3 + 2);
-            }
-            fineEmbedding = optimizeEmbedding1D(fineEmbedding, dir, &rp);
+            fineEmbedding = gradientStep(fineEmbedding, &objective, &cache, evals);
+            ++gradientEvals;
         }
         
         int cur;
@@ -189,7 +333,14 @@ vector<Vector3> refineEmbedding(TreeType *distanceField, const vector<Vector3> &
                 }
             }
             
-            DType err = computeFineError(dMatch, &rp);
+            //only the terms of the bones that depend on the two joints have a gradient
+            DType err = DType();
+            const vector<int> &curBones = rp.dependents[cur], &prevBones = rp.dependents[prev];
+            for(i = 1; i < sz; ++i)
+                if(find(curBones.begin(), curBones.end(), i) != curBones.end() ||
+                   find(prevBones.begin(), prevBones.end(), i) != prevBones.end())
+                    err += computeBoneError(dMatch, i, &rp);
+            ++gradientEvals; //with respect to one bone
             
             vector<Vector3> dir(sz);
         
@@ -206,10 +357,55 @@ vector<Vector3> refineEmbedding(TreeType *distanceField, const vector<Vector3> &
                     dir[i][2] = -err.getDeriv(varNum + 2);
                 }
             }
-            fineEmbedding = optimizeEmbedding1D(fineEmbedding, dir, &rp);
+            fineEmbedding = optimizeEmbedding1D(fineEmbedding, dir, &cache, evals);
         }
     }
+
+    Debugging::out() << "Refinement: " << evals << " error and " << gradientEvals << " gradient evaluations" << endl;
     
     return fineEmbedding;
 }
 
+vector<Vector3> refineEmbedding(TreeType *distanceField, const vector<Vector3> &medialSurface,
+                                const vector<Vector3> &initialEmbedding, const Skeleton &skeleton,
+                                Optimizer *optimizer, bool medialGrid)
+{
+    RP rp(distanceField, skeleton, medialSurface, medialGrid);
+    return refine(rp, initialEmbedding, optimizer);
+}
+
+vector<Vector3> refineBestEmbedding(TreeType *distanceField, const vector<Vector3> &medialSurface,
+                                    const vector<vector<Vector3> > &initialEmbeddings,
+                                    const Skeleton &skeleton, int *chosen, Optimizer *optimizer,
+                                    bool medialGrid)
+{
+    int i;
+    int num = initialEmbeddings.size();
+    RP rp(distanceField, skeleton, medialSurface, medialGrid); //only read by the refinements
+
+    //one embedding per thread--their logs would be interleaved, so they are dropped
+    vector<vector<Vector3> > refined(num);
+    vector<double> errors(num);
+
+#pragma omp parallel for schedule(dynamic, 1)
+    for(i = 0; i < num; ++i) {
+        Debugging::Quiet quiet;
+        Optimizer *threadOptimizer = optimizer ? optimizer->clone() : NULL; //it keeps counts
+        refined[i] = refine(rp, initialEmbeddings[i], threadOptimizer);
+        errors[i] = computeFineError(refined[i], &rp);
+        delete threadOptimizer;
+    }
+
+    int best = -1;
+    for(i = 0; i < num; ++i) {
+        Debugging::out() << "Embedding " << i << ": E = " << errors[i] << endl;
+        if(best < 0 || errors[i] < errors[best])
+            best = i;
+    }
+    Debugging::out() << "Best embedding: " << best << endl;
+
+    if(chosen)
+        *chosen = best;
+    return best < 0 ? vector<Vector3>() : refined[best];
+}
+
@@ -0,0 +1,54 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef TIMER_H_INCLUDED
+#define TIMER_H_INCLUDED
+
+#ifdef _WIN32
+#include <sys/timeb.h>
+#else
+#include <sys/time.h>
+#endif
+
+//wall clock stopwatch for time budgets and instrumentation
+class Timer
+{
+public:
+    Timer() { reset(); }
+
+    void reset() { start = now(); }
+    double elapsed() const { return now() - start; } //seconds since construction or reset
+
+    static double now()
+    {
+#ifdef _WIN32
+        struct _timeb tb;
+        _ftime(&tb);
+        return tb.time + tb.millitm * 0.001;
+#else
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+    }
+
+private:
+    double start;
+};
+
+#endif //TIMER_H_INCLUDED